@@ -1,5 +1,7 @@
 #include "drawrend.h"
 #include "svg.h"
+#include "stroke.h"
+#include "triangulation.h"
 #include "transforms.h"
 #include "CGL/misc.h"
 #include <iostream>
@@ -7,6 +9,9 @@
 #include "CGL/lodepng.h"
 #include "texture.h"
 #include <ctime>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 using namespace std;
 
 namespace CGL {
@@ -22,6 +27,9 @@ DrawRend::~DrawRend( void ) {}
 */
 void DrawRend::init() {
   sample_rate = 1;
+  sqrt_sample_rate = 1;
+  pattern = 0;
+  cell_samples = 1;
   left_clicked = false;
   show_zoom = 0;
 
@@ -33,7 +41,21 @@ void DrawRend::init() {
   current_svg = 0;
   psm = P_NEAREST;
   lsm = L_ZERO;
-
+  tiled = true;
+  recording = false;
+  snap = false;
+  strokes = STROKES_TESSELLATED;
+  fill = FILL_TRIANGULATED;
+  msaa = false;
+  adaptive = false;
+  occlude = false;
+  culled = 0;
+  filter = FILTER_BOX;
+  damageable = false;
+  linear = false;
+  sample_size = 4;
+  simd = simd_detect();
+  kernels = simd_kernels(simd);
 }
 
 /**
@@ -57,7 +79,9 @@ void DrawRend::resize( size_t w, size_t h ) {
   width = w; height = h;
 
   framebuffer.resize(4 * w * h);
-  superFramebuffer.resize(4 * sample_rate * w * h);
+  allocate_samples();
+  tiles_x = (width  + kTileSize - 1) / kTileSize;
+  tiles_y = (height + kTileSize - 1) / kTileSize;
 
   float scale = min(width, height);
   ndc_to_screen(0,0) = scale; ndc_to_screen(0,2) = (width  - scale) / 2;
@@ -66,22 +90,241 @@ void DrawRend::resize( size_t w, size_t h ) {
   redraw();
 }
 
+// color premultiplied by its alpha as a packed RGBA8 sample, see blend_over
+static inline uint32_t premultiply( const Color &color ) {
+  float a = std::min(std::max(color.a, 0.f), 1.f);
+  uint32_t Ea = (uint32_t) (a * 255 + .5f);
+  uint32_t rgb[3];
+  const float c[3] = { color.r, color.g, color.b };
+  for (int i = 0; i < 3; i++)
+    rgb[i] = std::min((uint32_t) (std::max(c[i], 0.f) * a * 255 + .5f), Ea);
+  return rgb[0] | rgb[1] << 8 | rgb[2] << 16 | Ea << 24;
+}
+
+// alpha-blends a premultiplied color into the sample at p, with one
+// packed load and store
+static inline void blend_sample( unsigned char *p, uint32_t src ) {
+  uint32_t d;
+  memcpy(&d, p, 4);
+  d = blend_over(d, src);
+  memcpy(p, &d, 4);
+}
+
+// Conversions between sRGB and linear light for the linear sample format:
+// decode maps each 8 bit sRGB value to linear light, and encode maps
+// linear light, quantized to 12 bits, back to the nearest 8 bit sRGB value.
+struct SrgbTables {
+  float decode[256];
+  unsigned char encode[4096];
+
+  SrgbTables() {
+    for (int i = 0; i < 256; i++) {
+      double c = i / 255.;
+      decode[i] = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+    }
+    for (int i = 0; i < 4096; i++) {
+      double l = i / 4095.;
+      double c = l <= 0.0031308 ? 12.92 * l : 1.055 * pow(l, 1 / 2.4) - 0.055;
+      encode[i] = (unsigned char) (c * 255 + .5);
+    }
+  }
+};
+static const SrgbTables srgb;
+
+static inline unsigned char encode_srgb( float l ) {
+  return srgb.encode[(int) (std::min(std::max(l, 0.f), 1.f) * 4095 + .5f)];
+}
+
+// A color ready to be blended into samples of either format: packed
+// premultiplied RGBA8, or premultiplied linear light RGBA floats.
+struct SampleSource {
+  bool linear;
+  uint32_t packed;
+  float premul[4];
+};
+
+static inline SampleSource sample_source( const Color &color, bool linear ) {
+  SampleSource src;
+  src.linear = linear;
+  if (!linear) {
+    src.packed = premultiply(color);
+    return src;
+  }
+  float a = std::min(std::max(color.a, 0.f), 1.f);
+  const float c[3] = { color.r, color.g, color.b };
+  for (int i = 0; i < 3; i++)
+    src.premul[i] = srgb.decode[(int) (std::min(std::max(c[i], 0.f), 1.f) * 255 + .5f)] * a;
+  src.premul[3] = a;
+  return src;
+}
+
+static inline void blend_sample( unsigned char *p, const SampleSource &src ) {
+  if (!src.linear) {
+    blend_sample(p, src.packed);
+    return;
+  }
+  float *d = (float *) p;
+  float ia = 1 - src.premul[3];
+  for (int c = 0; c < 4; c++)
+    d[c] = src.premul[c] + d[c] * ia;
+}
+
+static inline void blend_sample( unsigned char *p, const Color &color, bool linear ) {
+  blend_sample(p, sample_source(color, linear));
+}
+
+// sets n samples of either format to opaque white
+static void clear_samples( unsigned char *p, size_t n, bool linear ) {
+  if (!linear) {
+    memset(p, 255, 4 * n);
+    return;
+  }
+  float *d = (float *) p;
+  for (size_t i = 0; i < 4 * n; i++)
+    d[i] = 1;
+}
+
+// The sample patterns, by sample count. Offsets are in 1/16 pixel, from the
+// standard Direct3D patterns; 8x is an N-rooks pattern, with every sample
+// on a row and a column of its own.
+static const SamplePattern sample_patterns[] = {
+  { "1x", 1, 1 },
+  { "2x diagonal", 2, 0, { { 12/16., 12/16. }, {  4/16.,  4/16. } } },
+  { "4x ordered grid", 4, 2 },
+  { "4x rotated grid", 4, 0, { {  6/16.,  2/16. }, { 14/16.,  6/16. },
+                               {  2/16., 10/16. }, { 10/16., 14/16. } } },
+  { "8x N-rooks", 8, 0, { {  9/16.,  5/16. }, {  7/16., 11/16. },
+                          { 13/16.,  9/16. }, {  5/16.,  3/16. },
+                          {  3/16., 13/16. }, {  1/16.,  7/16. },
+                          { 11/16., 15/16. }, { 15/16.,  1/16. } } },
+  { "9x ordered grid", 9, 3 },
+  { "16x ordered grid", 16, 4 }
+};
+static const int kNumPatterns = sizeof(sample_patterns) / sizeof(sample_patterns[0]);
+
 /**
  * Return a brief description of the renderer.
  * Displays current buffer resolution, sampling method, sampling rate.
  */
 static const string level_strings[] = { "level zero", "nearest level", "bilinear level interpolation"};
 static const string pixel_strings[] = { "nearest pixel", "bilinear pixel interpolation"};
+static const string simd_strings[] = { "scalar", "SSE2", "AVX2" };
+static const string fill_strings[] = { "triangulation", "area coverage", "scanline spans" };
+static const string filter_strings[] = { "box", "tent", "Mitchell-Netravali", "Lanczos-2" };
+static const string stroke_strings[] = { "tessellated strokes", "hairline strokes", "antialiased hairline strokes" };
 std::string DrawRend::info() { 
   stringstream ss;
   stringstream sample_method;
   sample_method <<  level_strings[lsm] << ", " << pixel_strings[psm];
   ss << "Resolution " << width << " x " << height << ". ";
   ss << "Using " << sample_method.str() << " sampling. ";
-  ss << "Supersample rate " << sample_rate << " per pixel. ";
+  ss << "Supersample rate " << sample_rate << " per pixel ("
+     << sample_patterns[pattern].name << "). ";
+  if (tiled) {
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    ss << "Tiled rasterization on " << threads << " threads. ";
+    if (tile_resident()) {
+      int rows = band_rows();
+      ss << "Samples kept per band of " << rows << " pixel rows, in " << threads << " x "
+         << sample_size * sample_rate * kTileSize * rows / 1024 << " KB. ";
+    }
+  } else {
+    ss << "Immediate rasterization. ";
+  }
+  ss << "Using " << simd_strings[simd] << " sample kernels. ";
+  if (snap)
+    ss << "Snapping vertices to 1/256 sample, top-left fill rule. ";
+  ss << "Drawing " << stroke_strings[strokes] << ". ";
+  ss << "Filling polygons by " << fill_strings[fill] << ". ";
+  if (msaa)
+    ss << "Shading once per pixel (MSAA). ";
+  ss << "Resolving with a " << filter_strings[filter] << " filter";
+  if (filter != FILTER_BOX && (cell_samples != 1 || adaptive || linear))
+    ss << " (box for this sampling)";
+  ss << ". ";
+  if (linear)
+    ss << "Blending and resolving in linear light, in float samples. ";
+  if (!tile_resident())
+    ss << "Sample buffers of " << (superFramebuffer.size() + refineSamples.size()) / 1024
+       << " KB. ";
+  if (occlude)
+    ss << "Culling hidden samples of opaque triangles (" << culled
+       << " primitives skipped in whole tiles). ";
+  if (adaptive) {
+    int refined = 0;
+    for (size_t i = 0; i < refineSlots.size(); i++)
+      if (refineSlots[i] >= 0) refined++;
+    ss << "Adaptive supersampling: " << refined << " of " << refineSlots.size()
+       << " pixel blocks refined, in " << refineSamples.size() / 1024 << " KB. ";
+  }
   return ss.str(); 
 }
 
+/**
+ * Switches to sample pattern index and resizes the supersample buffer.
+ */
+void DrawRend::set_sample_pattern( int index ) {
+  pattern = index;
+  set_sample_layout(index);
+  allocate_samples();
+}
+
+/**
+ * Lays out the sample grid for sample pattern index, without changing the
+ * pattern in use or the buffer.
+ */
+void DrawRend::set_sample_layout( int index ) {
+  const SamplePattern &p = sample_patterns[index];
+  sample_rate = p.count;
+  sqrt_sample_rate = p.grid ? p.grid : 1;
+  cell_samples = p.grid ? 1 : p.count;
+}
+
+/**
+ * Returns the number of samples the supersample buffer holds: the pattern's
+ * count for every pixel, just one per pixel with adaptive supersampling,
+ * which keeps the extra samples of edge pixels in refineSamples, or none
+ * when the samples are tile resident.
+ */
+size_t DrawRend::buffer_samples() {
+  if (adaptive) return width * height;
+  if (tile_resident()) return 0;
+  return sample_patterns[pattern].count * width * height;
+}
+
+/**
+ * Whether the tiles keep their samples in a buffer of their own and
+ * resolve as soon as they are drawn. That takes tiled rasterization and a
+ * resolve that does not reach into the neighbouring tiles.
+ */
+bool DrawRend::tile_resident() {
+  bool filtered = filter != FILTER_BOX && sample_patterns[pattern].grid && !linear;
+  return tiled && !adaptive && !filtered;
+}
+
+/**
+ * Returns the height in pixels of the bands tile resident samples are
+ * drawn in: the most whole multiples of kBandAlign rows, up to the tile,
+ * whose samples fit in kBandSamples.
+ */
+int DrawRend::band_rows() {
+  int rows = kBandSamples / (kTileSize * sample_rate) / kBandAlign * kBandAlign;
+  return std::min(std::max(rows, kBandAlign), kTileSize);
+}
+
+/**
+ * Sizes the supersample buffer for the current mode. It is reallocated
+ * rather than resized, so that memory no longer needed is released.
+ */
+void DrawRend::allocate_samples() {
+  size_t size = sample_size * buffer_samples();
+  if (size != superFramebuffer.size())
+    std::vector<unsigned char>(size).swap(superFramebuffer);
+}
+
 /**
  * Respond to cursor events.
  * The viewer itself does not really care about the cursor but it will take
@@ -172,20 +415,16 @@ void DrawRend::keyboard_event( int key, int event, unsigned char mods ) {
       redraw();
       break;
 
-    // set the sampling rate to 1, 4, 9, or 16
+    // step through the sample patterns, from 1 to 16 samples per pixel
     case '=':
-      if (sample_rate < 16) {
-        sample_rate = (int)(sqrt(sample_rate)+1)*(sqrt(sample_rate)+1);
-        // Part 3: might need to add something here
-        superFramebuffer.resize(4 * sample_rate* width * height);
+      if (pattern + 1 < kNumPatterns) {
+        set_sample_pattern(pattern + 1);
         redraw();
       }
       break;
     case '-':
-      if (sample_rate > 1) {
-        sample_rate = (int)(sqrt(sample_rate)-1)*(sqrt(sample_rate)-1);
-        // Part 3: might need to add something here
-        superFramebuffer.resize(4 *sample_rate* width * height);
+      if (pattern > 0) {
+        set_sample_pattern(pattern - 1);
         redraw();
       }
       break;
@@ -195,14 +434,80 @@ void DrawRend::keyboard_event( int key, int event, unsigned char mods ) {
       write_screenshot();
       break;
 
-    // toggle pixel sampling scheme
+    // toggle pixel sampling scheme; only textured triangles change
     case 'P':
       psm = (PixelSampleMethod)((psm+1)%2);
-      redraw();
+      redraw_changed(textured_commands());
       break;
     // toggle level sampling scheme
     case 'L':
       lsm = (LevelSampleMethod)((lsm+1)%3);
+      redraw_changed(textured_commands());
+      break;
+
+    // toggle between tiled and immediate rasterization
+    case 'T':
+      tiled = !tiled;
+      allocate_samples();
+      redraw();
+      break;
+
+    // toggle fixed-point snapping with the top-left fill rule
+    case 'F':
+      snap = !snap;
+      redraw();
+      break;
+
+    // cycle through tessellated, hairline and antialiased hairline strokes
+    case 'W':
+      strokes = (StrokeMode)((strokes+1)%3);
+      redraw();
+      break;
+
+    // cycle through the polygon fill engines
+    case 'A':
+      fill = (FillMode)((fill+1)%3);
+      redraw();
+      break;
+
+    // toggle shading once per pixel instead of once per sample
+    case 'M':
+      msaa = !msaa;
+      redraw();
+      break;
+
+    // toggle skipping samples hidden by opaque triangles drawn later
+    case 'O':
+      occlude = !occlude;
+      redraw();
+      break;
+
+    // toggle supersampling only the pixels on primitive edges
+    case 'R':
+      adaptive = !adaptive;
+      allocate_samples();
+      redraw();
+      break;
+
+    // cycle through the reconstruction filters of the resolve
+    case 'K':
+      filter = (ResolveFilter)((filter+1)%4);
+      allocate_samples();
+      redraw();
+      break;
+
+    // toggle blending and resolving in linear light
+    case 'G':
+      linear = !linear;
+      sample_size = linear ? 4 * sizeof(float) : 4;
+      allocate_samples();
+      redraw();
+      break;
+
+    // cycle through the sample kernels the CPU supports
+    case 'V':
+      simd = (SimdLevel)((simd+1)%(simd_detect()+1));
+      kernels = simd_kernels(simd);
       redraw();
       break;
 
@@ -256,8 +561,23 @@ void DrawRend::write_screenshot() {
  * into the framebuffer before posting the framebuffer pixels to the screen.
  */
 void DrawRend::redraw() {
-  memset(&framebuffer[0], 255, 4 * width * height);
-  memset(&superFramebuffer[0], 255, 4 * sample_rate * width * height);
+  // adaptive supersampling draws the frame at one sample per pixel first
+  if (adaptive)
+    set_sample_layout(0);
+
+  // The framebuffer is not cleared: the resolve writes every pixel. The
+  // samples are cleared tile by tile before a tile is first drawn into,
+  // and tiles never drawn into resolve to white without being read.
+  tileCleared.assign(tiles_x * tiles_y, 0);
+
+  // in tiled mode the draw calls below only record primitives,
+  // which are then binned and rasterized tile by tile; adaptive
+  // supersampling records them as well, to replay them on the edges
+  commands.clear();
+  polygonVertices.clear();
+  recording = tiled || adaptive;
+  if (!recording)
+    clear_buffer();
 
   SVG &svg = *svgs[current_svg];
   svg.draw(this, ndc_to_screen*svg_to_ndc[current_svg]);
@@ -273,7 +593,60 @@ void DrawRend::redraw() {
   rasterize_line(d.x, d.y, b.x, b.y, Color::Black);
   rasterize_line(d.x, d.y, c.x, c.y, Color::Black);
 
-  resolve();
+  if (recording) {
+    recording = false;
+    if (tiled) {
+      flush_tiles();
+    } else {
+      clear_buffer();
+      for (size_t i = 0; i < commands.size(); i++)
+        execute(commands[i], buffer_rect());
+    }
+  }
+
+  // tile resident samples are resolved by flush_tiles already
+  if (!tile_resident())
+    resolve();
+  if (adaptive)
+    refine_edges();
+  draw_pixels();
+
+  // the commands and bins of this frame can redraw parts of it
+  damageable = tile_resident();
+}
+
+/**
+ * Returns which of the last frame's commands draw textured triangles,
+ * the only primitives whose samples depend on the texture sampling methods.
+ */
+std::vector<unsigned char> DrawRend::textured_commands() {
+  std::vector<unsigned char> textured(commands.size(), 0);
+  for (size_t i = 0; i < commands.size(); i++)
+    textured[i] = commands[i].type == RasterCommand::CMD_TRIANGLE &&
+                  dynamic_cast<TexTri *>(commands[i].tri) != NULL;
+  return textured;
+}
+
+/**
+ * Redraws the part of the frame that the commands of the last frame
+ * flagged in changed cover: every tile whose bin holds one of them, that
+ * is, that their screen bounding box overlaps, is drawn and resolved
+ * again from its bin. The other tiles keep their pixels. That takes the
+ * last frame to have been drawn with tile resident samples, and nothing
+ * but the look of the changed commands to differ since; otherwise the
+ * whole frame is redrawn.
+ */
+void DrawRend::redraw_changed( const std::vector<unsigned char> &changed ) {
+  if (!damageable || changed.size() != commands.size()) {
+    redraw();
+    return;
+  }
+
+  std::vector<unsigned char> damaged(bins.size(), 0);
+  for (size_t t = 0; t < bins.size(); t++)
+    for (size_t i = 0; i < bins[t].size() && !damaged[t]; i++)
+      damaged[t] = changed[bins[t][i]];
+  flush_tiles(&damaged);
   draw_pixels();
 }
 
@@ -282,31 +655,222 @@ void DrawRend::redraw() {
  * framebuffer pixel vector in preparation for draw_pixels();
  */
 void DrawRend::resolve() {
+  if (filter != FILTER_BOX && cell_samples == 1 && !adaptive && !linear) {
+    // the filters read across tiles
+    clear_buffer();
+    resolve_filtered();
+    return;
+  }
+
+  // row by row, so that memory is read in order; the runs of tiles not
+  // cleared are written white
+  int sqrtSR = sqrt_sample_rate;
+  SampleRect buffer = buffer_rect();
+  #pragma omp parallel for schedule(static)
+  for (int y = 0; y < (int) height; y++) {
+    const unsigned char *cleared = &tileCleared[(y / kTileSize) * tiles_x];
+    for (int tx = 0; tx < tiles_x; ) {
+      int end = tx;
+      while (end < tiles_x && cleared[end] == cleared[tx]) end++;
+      int x0 = tx * kTileSize, x1 = std::min(end * kTileSize, (int) width);
+      if (cleared[tx]) {
+        SampleRect r = buffer;
+        r.x0 = x0 * sqrtSR; r.x1 = x1 * sqrtSR;
+        r.y0 = y * sqrtSR; r.y1 = (y + 1) * sqrtSR;
+        r.samples = cell(buffer, r.x0, r.y0);
+        resolve(r);
+      } else {
+        memset(&framebuffer[0] + 4 * (y * width + x0), 255, 4 * (x1 - x0));
+      }
+      tx = end;
+    }
+  }
+}
+
+/**
+ * Sets the pixels of tile t to the clear color, white.
+ */
+void DrawRend::clear_pixels( int t ) {
+  int x0 = (t % tiles_x) * kTileSize, x1 = std::min(x0 + kTileSize, (int) width);
+  int y0 = (t / tiles_x) * kTileSize, y1 = std::min(y0 + kTileSize, (int) height);
+  for (int y = y0; y < y1; y++)
+    memset(&framebuffer[0] + 4 * (y * width + x0), 255, 4 * (x1 - x0));
+}
+
+/**
+ * Resolves the pixels whose samples rect holds into the framebuffer.
+ */
+void DrawRend::resolve( const SampleRect &rect ) {
   // Part 3: Fill this in
-  int sqrtSR = sqrt(sample_rate);
-  for (int scanY = 0; scanY < height; scanY++){
-    for (int scanX = 0; scanX < width; scanX++){
-      int blowupX = scanX*sqrtSR;
-      int blowupY = scanY*sqrtSR;
-      unsigned char* superP = &superFramebuffer[0] + 4*(blowupY*width*sqrtSR + blowupX);
-      unsigned char* p = &framebuffer[0] + 4*(scanY*width + scanX);
-      int newR = 0.0;
-      int newG = 0.0;
-      int newB = 0.0;
-      int newA = 0.0;
+  // the samples of a pixel are sqrtSR rows of sqrtSR cells, each holding
+  // cell_samples samples side by side. The sums are divided by multiplying
+  // with a fixed point reciprocal, see resolve_reciprocal.
+  int sqrtSR = sqrt_sample_rate;
+  int rowSamples = sqrtSR * cell_samples;
+  unsigned recip = resolve_reciprocal(sample_rate);
+  int startX = rect.x0 / sqrtSR, endX = rect.x1 / sqrtSR;
+  int startY = rect.y0 / sqrtSR, endY = rect.y1 / sqrtSR;
+
+  // rows are independent; the small rects of refine_edges are resolved by
+  // the thread that drew them
+  #pragma omp parallel for schedule(static) if (endY - startY > kTileSize)
+  for (int scanY = startY; scanY < endY; scanY++){
+    const unsigned char* superRow = cell(rect, startX*sqrtSR, scanY*sqrtSR);
+    unsigned char* p = &framebuffer[0] + 4*(scanY*width + startX);
+    if (linear) {
+      // average in linear light, then encode to sRGB
+      float scale = 1.f / sample_rate;
+      for (int scanX = startX; scanX < endX; scanX++, p += 4){
+        const unsigned char* superP = superRow + sample_size*rowSamples*(scanX - startX);
+        float sum[4] = { 0, 0, 0, 0 };
+        for (int sampleY = 0; sampleY < sqrtSR; sampleY++){
+          const float* samples = (const float*) superP;
+          for (int sampleX = 0; sampleX < rowSamples; sampleX++)
+            for (int c = 0; c < 4; c++)
+              sum[c] += samples[4*sampleX + c];
+          superP = superP + rect.stride;
+        }
+        for (int c = 0; c < 3; c++)
+          p[c] = encode_srgb(sum[c] * scale);
+        p[3] = (unsigned char) (std::min(sum[3] * scale, 1.f) * 255 + .5f);
+      }
+      continue;
+    }
+    if (kernels) {
+      kernels->resolve_span(superRow, rect.stride, sqrtSR, rowSamples, endX - startX, p);
+      continue;
+    }
+    for (int scanX = startX; scanX < endX; scanX++, p += 4){
+      const unsigned char* superP = superRow + 4*rowSamples*(scanX - startX);
+      unsigned newR = 0;
+      unsigned newG = 0;
+      unsigned newB = 0;
+      unsigned newA = 0;
       for (int sampleY = 0; sampleY < sqrtSR; sampleY++){
-        for (int sampleX = 0; sampleX < sqrtSR; sampleX++){
-          newR += (int) superP[0 + 4*sampleX];
-          newG += (int) superP[1 + 4*sampleX];
-          newB += (int) superP[2 + 4*sampleX];
-          newA += (int) superP[3 + 4*sampleX];
+        for (int sampleX = 0; sampleX < rowSamples; sampleX++){
+          newR += superP[0 + 4*sampleX];
+          newG += superP[1 + 4*sampleX];
+          newB += superP[2 + 4*sampleX];
+          newA += superP[3 + 4*sampleX];
+        }
+        superP = superP + rect.stride;
+      }
+      p[0] = (unsigned char) ((newR*recip) >> 16);
+      p[1] = (unsigned char) ((newG*recip) >> 16);
+      p[2] = (unsigned char) ((newB*recip) >> 16);
+      p[3] = (unsigned char) ((newA*recip) >> 16);
+    }
+  }
+}
+
+// Value of a reconstruction filter at distance x (in pixels) from the
+// pixel center, and its radius.
+static double filter_value( ResolveFilter filter, double x ) {
+  x = fabs(x);
+  switch (filter) {
+    case FILTER_TENT:
+      return max(0., 1 - x);
+    case FILTER_MITCHELL: {
+      const double B = 1/3., C = 1/3.;
+      if (x < 1)
+        return ((12 - 9*B - 6*C)*x*x*x + (-18 + 12*B + 6*C)*x*x + (6 - 2*B)) / 6;
+      if (x < 2)
+        return ((-B - 6*C)*x*x*x + (6*B + 30*C)*x*x + (-12*B - 48*C)*x + (8*B + 24*C)) / 6;
+      return 0;
+    }
+    case FILTER_LANCZOS: {
+      if (x < 1e-9) return 1;
+      if (x >= 2) return 0;
+      double px = PI * x;
+      return 2 * sin(px) * sin(px / 2) / (px * px);
+    }
+    default:
+      return x < .5 ? 1 : 0;
+  }
+}
+
+static int filter_radius( ResolveFilter filter ) {
+  return filter == FILTER_TENT ? 1 : 2;
+}
+
+// Scalar reference of RasterKernels::filter_column.
+static void filter_column( const unsigned char *const *rows, int taps, const float *w,
+                           int n, float *out ) {
+  for (int i = 0; i < n; i++) {
+    float acc = 0;
+    for (int k = 0; k < taps; k++)
+      acc += w[k] * rows[k][i];
+    out[i] = acc;
+  }
+}
+
+// Scalar reference of RasterKernels::filter_row.
+static void filter_row( const float *p, int n, int taps, int step, const float *w,
+                        unsigned char *out ) {
+  for (int i = 0; i < n; i++, p += 4 * step) {
+    for (int c = 0; c < 4; c++) {
+      float acc = 0;
+      for (int k = 0; k < taps; k++)
+        acc += w[k] * p[4 * k + c];
+      acc = min(max(acc, 0.f), 255.f);
+      out[4 * i + c] = (unsigned char) (acc + .5f);
+    }
+  }
+}
+
+/**
+ * Resolves the ordered grid in the buffer with the current reconstruction
+ * filter, as a vertical pass over the sample rows of each pixel row
+ * followed by a horizontal pass. Both use the same table of taps weights,
+ * the filter's values at the sample centers within its radius of the
+ * pixel center, normalized to sum to 1; samples beyond the buffer's edges
+ * repeat the edge samples.
+ */
+void DrawRend::resolve_filtered() {
+  int sqrtSR = sqrt_sample_rate;
+  int radius = filter_radius(filter);
+  int taps = 2 * radius * sqrtSR;
+  // the first tap of pixel x is sample x * sqrtSR + first
+  int first = sqrtSR / 2 - radius * sqrtSR;
+  vector<float> weights(taps);
+  double total = 0;
+  for (int k = 0; k < taps; k++)
+    total += filter_value(filter, (first + k + .5) / sqrtSR - .5);
+  for (int k = 0; k < taps; k++)
+    weights[k] = filter_value(filter, (first + k + .5) / sqrtSR - .5) / total;
+
+  SampleRect buffer = buffer_rect();
+  int w = buffer.x1, h = buffer.y1;
+  int pad = radius * sqrtSR;
+
+  #pragma omp parallel
+  {
+    // a row of column-filtered samples, padded on both sides
+    vector<float> line(4 * (w + 2 * pad));
+    vector<const unsigned char *> rows(taps);
+    #pragma omp for schedule(static)
+    for (int y = 0; y < (int) height; y++) {
+      for (int k = 0; k < taps; k++) {
+        int sy = min(max(y * sqrtSR + first + k, 0), h - 1);
+        rows[k] = cell(buffer, 0, sy);
+      }
+      float *samples = &line[4 * pad];
+      if (kernels)
+        kernels->filter_column(&rows[0], taps, &weights[0], 4 * w, samples);
+      else
+        filter_column(&rows[0], taps, &weights[0], 4 * w, samples);
+      for (int i = 0; i < pad; i++) {
+        for (int c = 0; c < 4; c++) {
+          samples[4 * (-1 - i) + c] = samples[c];
+          samples[4 * (w + i) + c] = samples[4 * (w - 1) + c];
         }
-        superP = superP + width*sqrtSR*4;
       }
-      p[0] = (unsigned char) (newR/sample_rate);
-      p[1] = (unsigned char) (newG/sample_rate);
-      p[2] = (unsigned char) (newB/sample_rate);
-      p[3] = (unsigned char) (newA/sample_rate);
+
+      unsigned char *p = &framebuffer[0] + 4 * y * width;
+      if (kernels)
+        kernels->filter_row(samples + 4 * first, (int) width, taps, sqrtSR, &weights[0], p);
+      else
+        filter_row(samples + 4 * first, (int) width, taps, sqrtSR, &weights[0], p);
     }
   }
 }
@@ -450,133 +1014,1881 @@ void DrawRend::move_view(float dx, float dy, float zoom) {
                                       0, 0, 2*span*zoom);
 }
 
+/**
+ * Returns the rectangle covering the whole supersample buffer.
+ */
+DrawRend::SampleRect DrawRend::buffer_rect() {
+  int sqrtSR = sqrt_sample_rate;
+  SampleRect r = { 0, 0, (int) width * sqrtSR, (int) height * sqrtSR,
+                   superFramebuffer.data(), sample_size * cell_samples * (int) width * sqrtSR,
+                   NULL, 0 };
+  return r;
+}
+
+/**
+ * Returns the rectangle of the supersample buffer that tile t covers.
+ */
+DrawRend::SampleRect DrawRend::tile_rect( int t ) {
+  int tileSamples = kTileSize * sqrt_sample_rate;
+  SampleRect buffer = buffer_rect();
+  SampleRect r = buffer;
+  r.x0 = (t % tiles_x) * tileSamples;
+  r.y0 = (t / tiles_x) * tileSamples;
+  r.x1 = std::min(r.x0 + tileSamples, buffer.x1);
+  r.y1 = std::min(r.y0 + tileSamples, buffer.y1);
+  r.samples = buffer.samples ? cell(buffer, r.x0, r.y0) : NULL;
+  return r;
+}
+
+/**
+ * Clears the samples of tile t in the supersample buffer, unless they
+ * have been cleared this frame already.
+ */
+void DrawRend::clear_tile( int t ) {
+  if (tileCleared[t]) return;
+  SampleRect r = tile_rect(t);
+  for (int y = r.y0; y < r.y1; y++)
+    clear_samples(cell(r, r.x0, y), cell_samples * (r.x1 - r.x0), linear);
+  tileCleared[t] = 1;
+}
+
+/**
+ * Clears every tile of the supersample buffer not cleared yet, row by
+ * row of samples.
+ */
+void DrawRend::clear_buffer() {
+  int tileSamples = kTileSize * sqrt_sample_rate;
+  SampleRect buffer = buffer_rect();
+  #pragma omp parallel for schedule(static)
+  for (int y = 0; y < buffer.y1; y++) {
+    const unsigned char *cleared = &tileCleared[(y / tileSamples) * tiles_x];
+    for (int tx = 0; tx < tiles_x; ) {
+      int end = tx;
+      while (end < tiles_x && cleared[end] == cleared[tx]) end++;
+      if (!cleared[tx]) {
+        int x0 = tx * tileSamples, x1 = std::min(end * tileSamples, buffer.x1);
+        clear_samples(cell(buffer, x0, y), cell_samples * (x1 - x0), linear);
+      }
+      tx = end;
+    }
+  }
+  tileCleared.assign(tileCleared.size(), 1);
+}
+
+/**
+ * Appends a primitive to the command list of the current frame.
+ */
+void DrawRend::record( const RasterCommand &cmd ) {
+  commands.push_back(cmd);
+}
+
+/**
+ * Adds a recorded primitive to the bin of every tile that its
+ * (conservative) supersample bounding box overlaps.
+ */
+void DrawRend::bin_command( int index ) {
+  const RasterCommand &cmd = commands[index];
+  float sqrtSR = sqrt_sample_rate;
+  float minX, maxX, minY, maxY;
+
+  switch (cmd.type) {
+    case RasterCommand::CMD_POINT:
+      // points are already given in supersample coordinates
+      minX = maxX = cmd.x0;
+      minY = maxY = cmd.y0;
+      break;
+    case RasterCommand::CMD_LINE:
+      // lines are drawn sqrtSR samples wide, to the right of / below the path
+      minX = sqrtSR * std::min(cmd.x0, cmd.x1);
+      maxX = sqrtSR * std::max(cmd.x0, cmd.x1) + sqrtSR;
+      minY = sqrtSR * std::min(cmd.y0, cmd.y1);
+      maxY = sqrtSR * std::max(cmd.y0, cmd.y1) + sqrtSR;
+      break;
+    case RasterCommand::CMD_TRIANGLE:
+      minX = sqrtSR * std::min(cmd.x0, std::min(cmd.x1, cmd.x2));
+      maxX = sqrtSR * std::max(cmd.x0, std::max(cmd.x1, cmd.x2));
+      minY = sqrtSR * std::min(cmd.y0, std::min(cmd.y1, cmd.y2));
+      maxY = sqrtSR * std::max(cmd.y0, std::max(cmd.y1, cmd.y2));
+      break;
+    case RasterCommand::CMD_POLYGON:
+      // coverage reaches every sample of the pixels the box touches
+      minX = sqrtSR * cmd.x0;
+      maxX = sqrtSR * cmd.x1 + sqrtSR;
+      minY = sqrtSR * cmd.y0;
+      maxY = sqrtSR * cmd.y1 + sqrtSR;
+      break;
+    default:
+      return;
+  }
+
+  // pad by a sample for rounding and clamp to the buffer in float;
+  // this also drops NaN bounds
+  SampleRect buffer = buffer_rect();
+  minX = std::max(minX - 1, 0.f); maxX = std::min(maxX + 1, buffer.x1 - 1.f);
+  minY = std::max(minY - 1, 0.f); maxY = std::min(maxY + 1, buffer.y1 - 1.f);
+  if (!(minX <= maxX && minY <= maxY)) return;
+
+  int tileSamples = kTileSize * sqrtSR;
+  int tx0 = (int) minX / tileSamples, tx1 = (int) maxX / tileSamples;
+  int ty0 = (int) minY / tileSamples, ty1 = (int) maxY / tileSamples;
+  for (int ty = ty0; ty <= ty1; ty++)
+    for (int tx = tx0; tx <= tx1; tx++)
+      bins[ty * tiles_x + tx].push_back(index);
+}
+
+/**
+ * Sorts the recorded primitives into the bins of the tiles.
+ */
+void DrawRend::bin_commands() {
+  bins.resize(tiles_x * tiles_y);
+  for (size_t i = 0; i < bins.size(); i++)
+    bins[i].clear();
+  for (int i = 0; i < (int) commands.size(); i++)
+    bin_command(i);
+}
+
+/**
+ * Bins the recorded primitives and rasterizes the tiles in parallel.
+ * Every tile replays its primitives in recording order and each sample
+ * belongs to exactly one tile, so painter's order holds and the result
+ * is identical to rasterizing the primitives immediately. Tiles with
+ * empty bins are left clear. Tile resident samples are drawn into a
+ * buffer of the thread's own a band of band_rows() rows at a time, the
+ * tile's primitives replayed for every band, and each band is resolved
+ * into the framebuffer when it is done; the buffer holds kBandSamples
+ * samples at most whatever the sample rate. Given damaged, only the tiles
+ * it flags are drawn again, from the bins of the last frame.
+ */
+void DrawRend::flush_tiles( const std::vector<unsigned char> *damaged ) {
+  int sqrtSR = sqrt_sample_rate;
+  int tileSamples = kTileSize * sqrtSR;
+  bool resident = tile_resident();
+  int bandSamples = resident ? band_rows() * sqrtSR : tileSamples;
+  if (!damaged)
+    bin_commands();
+
+  // the pre-pass works on the triangle traversal of ordered grids
+  bool cull = occlude && cell_samples == 1;
+  int skipped = 0;
+
+  #pragma omp parallel reduction(+:skipped)
+  {
+    std::vector<unsigned char> tileBuffer;
+    if (resident)
+      tileBuffer.resize(sample_size * cell_samples * tileSamples * bandSamples);
+
+    #pragma omp for schedule(dynamic, 1)
+    for (int t = 0; t < (int) bins.size(); t++) {
+      if (damaged && !(*damaged)[t]) continue;
+
+      // tiles nothing is drawn into stay clear
+      const std::vector<int> &bin = bins[t];
+      if (bin.empty()) {
+        if (resident)
+          clear_pixels(t);
+        continue;
+      }
+
+      SampleRect tile = tile_rect(t);
+      if (!resident)
+        clear_tile(t);
+
+      // the primitives skipped in every band are skipped in the whole tile
+      int tileSkipped = (int) bin.size();
+      for (int y0 = tile.y0; y0 < tile.y1; y0 += bandSamples) {
+        SampleRect clip = tile;
+        if (resident) {
+          clip.y0 = y0;
+          clip.y1 = std::min(y0 + bandSamples, tile.y1);
+          clip.samples = &tileBuffer[0];
+          clip.stride = sample_size * cell_samples * tileSamples;
+          clear_samples(clip.samples, cell_samples * tileSamples * (clip.y1 - clip.y0), linear);
+        }
+
+        Occlusion occ;
+        int first = 0;
+        if (cull) {
+          occlude_tile(bin, clip, occ);
+          clip.occlusion = &occ;
+          first = occ.tileHiddenBefore;
+          tileSkipped = std::min(tileSkipped, first);
+        }
+        for (int i = first; i < (int) bin.size(); i++) {
+          clip.position = i;
+          execute(commands[bin[i]], clip);
+        }
+        if (resident)
+          resolve(clip);
+      }
+      if (cull)
+        skipped += tileSkipped;
+    }
+  }
+  if (!damaged)
+    culled = skipped;
+}
+
+
+/**
+ * Rasterizes a recorded primitive restricted to clip.
+ */
+void DrawRend::execute( const RasterCommand &cmd, const SampleRect &clip ) {
+  switch (cmd.type) {
+    case RasterCommand::CMD_POINT:
+      rasterize_point(cmd.x0, cmd.y0, cmd.color, clip);
+      break;
+    case RasterCommand::CMD_LINE:
+      rasterize_line(cmd.x0, cmd.y0, cmd.x1, cmd.y1, cmd.color, clip);
+      break;
+    case RasterCommand::CMD_TRIANGLE:
+      rasterize_triangle(cmd.x0, cmd.y0, cmd.x1, cmd.y1, cmd.x2, cmd.y2,
+                         cmd.color, cmd.tri, clip);
+      break;
+    case RasterCommand::CMD_POLYGON:
+      rasterize_polygon(&polygonVertices[cmd.first], cmd.count,
+                        cmd.color, cmd.rule, clip);
+      break;
+  }
+}
+
+// Marks the pixels of a width x height mask that the segment p-q passes
+// through, and those up to pad pixels around them. Rows are walked in
+// pixels, each marking the columns the segment spans within it.
+static void mark_segment( std::vector<unsigned char> &mask, int width, int height,
+                          Vector2D p, Vector2D q, int pad ) {
+  if (!(std::isfinite(p.x) && std::isfinite(p.y) &&
+        std::isfinite(q.x) && std::isfinite(q.y))) return;
+  if (p.y > q.y) swap(p, q);
+  double top = std::max(floor(p.y), -1.), bottom = std::min(floor(q.y), (double) height);
+  double dxdy = q.y > p.y ? (q.x - p.x) / (q.y - p.y) : 0;
+
+  for (double row = top; row <= bottom; row++) {
+    // the columns of the piece of the segment within the row
+    double xa = p.x, xb = q.x;
+    if (q.y > p.y) {
+      xa = p.x + (std::max(row, p.y) - p.y) * dxdy;
+      xb = p.x + (std::min(row + 1, q.y) - p.y) * dxdy;
+    }
+    if (xa > xb) swap(xa, xb);
+    int x0 = (int) std::max(floor(xa) - pad, 0.);
+    int x1 = (int) std::min(floor(xb) + pad, width - 1.);
+    if (x0 > x1) continue;
+
+    int y0 = std::max((int) row - pad, 0), y1 = std::min((int) row + pad, height - 1);
+    for (int y = y0; y <= y1; y++)
+      memset(&mask[y * width + x0], 1, x1 - x0 + 1);
+  }
+}
+
+// Marks the pixels of a width x height mask that the triangle v[0..2]
+// overlaps, inside and on its edges. A triangle is convex, so its piece
+// within a row spans from the leftmost to the rightmost column its edges
+// reach within the row.
+static void mark_triangle( std::vector<unsigned char> &mask, int width, int height,
+                           const Vector2D v[3] ) {
+  for (int i = 0; i < 3; i++)
+    if (!(std::isfinite(v[i].x) && std::isfinite(v[i].y))) return;
+  double top = std::min(v[0].y, std::min(v[1].y, v[2].y));
+  double bottom = std::max(v[0].y, std::max(v[1].y, v[2].y));
+  top = std::max(floor(top), 0.);
+  bottom = std::min(floor(bottom), height - 1.);
+
+  for (double row = top; row <= bottom; row++) {
+    double xa = INFINITY, xb = -INFINITY;
+    for (int i = 0; i < 3; i++) {
+      Vector2D p = v[i], q = v[(i + 1) % 3];
+      if (p.y > q.y) swap(p, q);
+      double ya = std::max(row, p.y), yb = std::min(row + 1, q.y);
+      if (ya > yb) continue;
+      double xp = p.x, xq = q.x;
+      if (q.y > p.y) {
+        double dxdy = (q.x - p.x) / (q.y - p.y);
+        xp = p.x + (ya - p.y) * dxdy;
+        xq = p.x + (yb - p.y) * dxdy;
+      }
+      xa = std::min(xa, std::min(xp, xq));
+      xb = std::max(xb, std::max(xp, xq));
+    }
+    int x0 = (int) std::max(floor(xa), 0.);
+    int x1 = (int) std::min(floor(xb), width - 1.);
+    if (x0 > x1) continue;
+    memset(&mask[(int) row * width + x0], 1, x1 - x0 + 1);
+  }
+}
+
+/**
+ * Marks the pixels of edgePixels whose samples one sample per pixel may
+ * not decide: the pixels the edges of a recorded primitive cross. A pixel
+ * no edge of a triangle or polygon crosses lies wholly inside or outside
+ * of it, and flat and color-interpolated shading take the same value at
+ * the pixel's center as on average over its samples, the latter up to the
+ * rounding of each sample to 8 bits. Textured triangles shaded per sample
+ * do not, so without MSAA every pixel they overlap is marked. Lines are
+ * thin enough to count as edges throughout, and points are given in
+ * samples, so the pixel they fall in at one sample per pixel and at the
+ * full rate are both marked.
+ */
+void DrawRend::mark_edges( const RasterCommand &cmd ) {
+  int w = width, h = height;
+  switch (cmd.type) {
+    case RasterCommand::CMD_POINT:
+      mark_segment(edgePixels, w, h, Vector2D(cmd.x0, cmd.y0), Vector2D(cmd.x0, cmd.y0), 0);
+      mark_segment(edgePixels, w, h, Vector2D(cmd.x0, cmd.y0) / sqrt_sample_rate,
+                                     Vector2D(cmd.x0, cmd.y0) / sqrt_sample_rate, 0);
+      break;
+    case RasterCommand::CMD_LINE:
+      mark_segment(edgePixels, w, h, Vector2D(cmd.x0, cmd.y0), Vector2D(cmd.x1, cmd.y1), 1);
+      break;
+    case RasterCommand::CMD_TRIANGLE: {
+      Vector2D v[3] = { Vector2D(cmd.x0, cmd.y0), Vector2D(cmd.x1, cmd.y1),
+                        Vector2D(cmd.x2, cmd.y2) };
+      if (!msaa && cmd.tri && !dynamic_cast<ColorTri *>(cmd.tri)) {
+        mark_triangle(edgePixels, w, h, v);
+        break;
+      }
+      for (int i = 0; i < 3; i++)
+        mark_segment(edgePixels, w, h, v[i], v[(i + 1) % 3], 0);
+      break;
+    }
+    case RasterCommand::CMD_POLYGON: {
+      const Vector2D *v = &polygonVertices[cmd.first];
+      for (int i = 0; i < cmd.count; i++)
+        mark_segment(edgePixels, w, h, v[i], v[(i + 1) % cmd.count], 0);
+      break;
+    }
+  }
+}
+
+/**
+ * Refines the frame drawn at one sample per pixel on the edges. The blocks
+ * of kRefineSize x kRefineSize pixels holding an edge pixel each get a slot
+ * of samples at the pattern's full rate; every block replays the primitives
+ * binned to its tile clipped to itself, into its slot, and is resolved over
+ * the framebuffer. Memory and work so grow with the length of the edges
+ * rather than with the area of the frame.
+ */
+void DrawRend::refine_edges() {
+  set_sample_layout(pattern);
+  refineSlots.clear();
+  refineSamples.clear();
+  if (sample_rate == 1) return;
+
+  edgePixels.assign(width * height, 0);
+  for (size_t i = 0; i < commands.size(); i++)
+    mark_edges(commands[i]);
+
+  int blocksX = (width + kRefineSize - 1) / kRefineSize;
+  int blocksY = (height + kRefineSize - 1) / kRefineSize;
+  refineSlots.assign(blocksX * blocksY, -1);
+  int slots = 0;
+  for (int b = 0; b < blocksX * blocksY; b++) {
+    int x0 = (b % blocksX) * kRefineSize, x1 = std::min(x0 + kRefineSize, (int) width);
+    int y0 = (b / blocksX) * kRefineSize, y1 = std::min(y0 + kRefineSize, (int) height);
+    bool edge = false;
+    for (int y = y0; y < y1 && !edge; y++)
+      for (int x = x0; x < x1 && !edge; x++)
+        edge = edgePixels[y * width + x];
+    if (edge) refineSlots[b] = slots++;
+  }
+
+  int blockSamples = kRefineSize * sqrt_sample_rate;
+  int blockStride = sample_size * cell_samples * blockSamples;
+  size_t blockBytes = (size_t) blockStride * blockSamples;
+  refineSamples.resize(slots * blockBytes);
+  if (slots)
+    clear_samples(&refineSamples[0], refineSamples.size() / sample_size, linear);
+
+  SampleRect buffer = buffer_rect();
+  const int blocksPerTile = kTileSize / kRefineSize;
+  bin_commands();
+
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (int t = 0; t < (int) bins.size(); t++) {
+    int bx0 = (t % tiles_x) * blocksPerTile, bx1 = std::min(bx0 + blocksPerTile, blocksX);
+    int by0 = (t / tiles_x) * blocksPerTile, by1 = std::min(by0 + blocksPerTile, blocksY);
+    const std::vector<int> &bin = bins[t];
+    for (int by = by0; by < by1; by++) {
+      for (int bx = bx0; bx < bx1; bx++) {
+        int slot = refineSlots[by * blocksX + bx];
+        if (slot < 0) continue;
+
+        SampleRect clip = buffer;
+        clip.x0 = bx * blockSamples;
+        clip.y0 = by * blockSamples;
+        clip.x1 = std::min(clip.x0 + blockSamples, buffer.x1);
+        clip.y1 = std::min(clip.y0 + blockSamples, buffer.y1);
+        clip.samples = &refineSamples[slot * blockBytes];
+        clip.stride = blockStride;
+        for (size_t i = 0; i < bin.size(); i++)
+          execute(commands[bin[i]], clip);
+        resolve(clip);
+      }
+    }
+  }
+}
+
+// Number of unit steps the line walk takes to cover a length of len.
+static int line_steps( double len ) {
+  return (int) std::max(1.0, std::min(ceil(len), 1e9));
+}
+
+// Narrows the step range [kLo,kHi] of the walk p0 + k*d to the steps that
+// land in [lo,hi], clipping the line parametrically (Liang-Barsky) one
+// slab at a time. Empties the range if no step does.
+static void clip_steps( double p0, double d, double lo, double hi,
+                        int &kLo, int &kHi ) {
+  if (d == 0) {
+    if (!(p0 >= lo && p0 <= hi)) kHi = kLo - 1;
+    return;
+  }
+  double k0 = (lo - p0) / d, k1 = (hi - p0) / d;
+  if (k0 > k1) std::swap(k0, k1);
+  if (!(k0 <= kHi && k1 >= kLo)) {
+    kHi = kLo - 1;
+    return;
+  }
+  kLo = (int) floor(std::max(k0, (double) kLo));
+  kHi = (int) ceil(std::min(k1, (double) kHi));
+}
+
   // rasterize a point
 void DrawRend::rasterize_point( float x, float y, Color color ) {
+  if (recording) {
+    RasterCommand cmd = { RasterCommand::CMD_POINT, x, y, 0, 0, 0, 0, color, NULL };
+    record(cmd);
+  } else {
+    rasterize_point(x, y, color, buffer_rect());
+  }
+}
+
+void DrawRend::rasterize_point( float x, float y, Color color, const SampleRect &clip ) {
   // fill in the nearest pixel
-  int sqrtSR = sqrt(sample_rate);
   int sx = (int) floor(x);
   int sy = (int) floor(y);
 
   // check bounds
-  if ( sx < 0 || sx >= sqrtSR*width ) return;
-  if ( sy < 0 || sy >= sqrtSR*height ) return;
+  if ( sx < clip.x0 || sx >= clip.x1 ) return;
+  if ( sy < clip.y0 || sy >= clip.y1 ) return;
 
   // perform alpha blending with previous value
-  unsigned char *p = &superFramebuffer[0] + 4 * (sx + sy*width*sqrtSR);
-  float Ca = p[3] / 255., Ea = color.a;
-  p[0] = (uint8_t) (color.r * 255 * Ea + (1 - Ea) * p[0]);
-  p[1] = (uint8_t) (color.g * 255 * Ea + (1 - Ea) * p[1]);
-  p[2] = (uint8_t) (color.b * 255 * Ea + (1 - Ea) * p[2]);
-  p[3] = (uint8_t) ((1 - (1 - Ea) * (1 - Ca)) * 255);
+  fill_span(sx, sx, sy, color, clip);
 }
 
   // rasterize a line
 void DrawRend::rasterize_line( float x0, float y0,
                      float x1, float y1,
                      Color color) {
+  if (recording) {
+    RasterCommand cmd = { RasterCommand::CMD_LINE, x0, y0, x1, y1, 0, 0, color, NULL };
+    record(cmd);
+  } else {
+    rasterize_line(x0, y0, x1, y1, color, buffer_rect());
+  }
+}
+
+// fractional bits of the minor-axis position in the line walk
+static const int kLineFrac = 32;
+
+void DrawRend::rasterize_line( float x0, float y0,
+                     float x1, float y1,
+                     Color color, const SampleRect &clip) {
+  if (strokes == STROKES_ANTIALIASED) {
+    rasterize_line_antialiased(x0, y0, x1, y1, color, clip);
+    return;
+  }
 
-  // Part 1: Fill this in
-  float sqrtSR = sqrt(sample_rate);
+  int sqrtSR = sqrt_sample_rate;
   float blowupX0 = sqrtSR*x0;
   float blowupY0 = sqrtSR*y0;
   float blowupX1 = sqrtSR*x1;
   float blowupY1 = sqrtSR*y1;
 
-  float slope = (blowupY1 - blowupY0)/(blowupX1 - blowupX0);
-  if (std::abs(slope) <= 1){
-    if (blowupX0 > blowupX1) {
-      swap(blowupX0, blowupX1); swap(blowupY0, blowupY1);
+  // Walk the major axis u one sample per step and track the minor axis v
+  // in fixed point. Each step covers sqrtSR samples across the line. A
+  // zero-length line counts as y-major.
+  bool xMajor = blowupX1 != blowupX0 &&
+                std::abs(blowupY1 - blowupY0) <= std::abs(blowupX1 - blowupX0);
+  double u0 = xMajor ? blowupX0 : blowupY0, v0 = xMajor ? blowupY0 : blowupX0;
+  double u1 = xMajor ? blowupX1 : blowupY1, v1 = xMajor ? blowupY1 : blowupX1;
+  if (u0 > u1) {
+    swap(u0, u1); swap(v0, v1);
+  }
+  double dv = u1 > u0 ? (v1 - v0) / (u1 - u0) : 0;
+
+  SampleRect buffer = buffer_rect();
+  int bufU0 = xMajor ? buffer.x0 : buffer.y0, bufU1 = xMajor ? buffer.x1 : buffer.y1;
+  int bufV0 = xMajor ? buffer.y0 : buffer.x0, bufV1 = xMajor ? buffer.y1 : buffer.x1;
+  int clipU0 = xMajor ? clip.x0 : clip.y0, clipU1 = xMajor ? clip.x1 : clip.y1;
+  int clipV0 = xMajor ? clip.y0 : clip.x0, clipV1 = xMajor ? clip.y1 : clip.x1;
+
+  // The fixed-point walk is anchored at the first step inside the buffer,
+  // which every tile agrees on; a tile then skips ahead to its own steps
+  // with exact integer arithmetic and produces the same samples.
+  int kA = 0, kB = line_steps(u1 - u0) - 1;
+  clip_steps(u0, 1, bufU0 - 1, bufU1 + 1, kA, kB);
+  clip_steps(v0, dv, bufV0 - sqrtSR - 1, bufV1 + 1, kA, kB);
+  int kLo = kA, kHi = kB;
+  clip_steps(u0, 1, clipU0 - 1, clipU1 + 1, kLo, kHi);
+  clip_steps(v0, dv, clipV0 - sqrtSR - 1, clipV1 + 1, kLo, kHi);
+  if (kLo > kHi) return;
+
+  const double one = (double) (1LL << kLineFrac);
+  int64_t step = (int64_t) floor(dv * one + 0.5);
+  int64_t v = (int64_t) floor((v0 + kA * dv) * one + 0.5) + (int64_t) (kLo - kA) * step;
+  int u = (int) floor(u0 + kLo);
+
+  if (xMajor) {
+    // steps with the same row form a run, filled as a rectangle of rows
+    // row..row+sqrtSR-1 over the run's columns
+    for (int k = kLo; k <= kHi; ) {
+      int row = (int) (v >> kLineFrac), first = u;
+      do {
+        k++; u++; v += step;
+      } while (k <= kHi && (int) (v >> kLineFrac) == row);
+      int spanX0 = std::max(first, clip.x0), spanX1 = std::min(u - 1, clip.x1 - 1);
+      if (spanX0 > spanX1) continue;
+      for (int y = std::max(row, clip.y0); y < std::min(row + sqrtSR, clip.y1); y++)
+        fill_span(spanX0, spanX1, y, color, clip);
     }
-    slope = (blowupY1 - blowupY0)/(blowupX1 - blowupX0);
-    do {
-      for (int i = 0; i < sqrtSR; i++){
-        this->DrawRend::rasterize_point(blowupX0, blowupY0 + i, color);
-      }
-      blowupX0 += 1;
-      blowupY0 += slope;
-    }while (blowupX0 < blowupX1);
   } else {
-    if (blowupY0 > blowupY1) {
-      swap(blowupX0, blowupX1); swap(blowupY0, blowupY1);
+    // every step is a span of sqrtSR samples on its own row
+    for (int k = kLo; k <= kHi; k++, u++, v += step) {
+      if (u < clip.y0 || u >= clip.y1) continue;
+      int col = (int) (v >> kLineFrac);
+      int spanX0 = std::max(col, clip.x0), spanX1 = std::min(col + sqrtSR - 1, clip.x1 - 1);
+      if (spanX0 <= spanX1)
+        fill_span(spanX0, spanX1, u, color, clip);
+    }
+  }
+}
+
+/**
+ * Draws the line as a one-pixel-wide bar along its major axis, in the manner
+ * of Xiaolin Wu: in each pixel column (row, for a y-major line) the bar
+ * covers the two pixels around the line's height at the column center, in
+ * proportion to their overlap with it, and partial columns at the ends are
+ * scaled by how much of the column the line spans. Coverage is computed in
+ * pixels, independently per pixel, and blended into all of the pixel's
+ * samples, so tiles agree and the result does not depend on the sample rate.
+ */
+void DrawRend::rasterize_line_antialiased( float x0, float y0,
+                                           float x1, float y1,
+                                           Color color, const SampleRect &clip) {
+  int sqrtSR = sqrt_sample_rate;
+  double dx = (double) x1 - x0, dy = (double) y1 - y0;
+  if (!(dx != 0 || dy != 0)) return;
+
+  bool xMajor = std::abs(dy) <= std::abs(dx);
+  double u0 = xMajor ? x0 : y0, v0 = xMajor ? y0 : x0;
+  double u1 = xMajor ? x1 : y1, v1 = xMajor ? y1 : x1;
+  if (u0 > u1) {
+    swap(u0, u1); swap(v0, v1);
+  }
+  double slope = (v1 - v0) / (u1 - u0);
+
+  // the clip rectangle in pixels; tiles start and end on pixel boundaries
+  int clipU0 = (xMajor ? clip.x0 : clip.y0) / sqrtSR;
+  int clipU1 = (xMajor ? clip.x1 : clip.y1) / sqrtSR;
+  int clipV0 = (xMajor ? clip.y0 : clip.x0) / sqrtSR;
+  int clipV1 = (xMajor ? clip.y1 : clip.x1) / sqrtSR;
+
+  double first = std::max(floor(u0), (double) clipU0);
+  double last = std::min(floor(u1), (double) clipU1 - 1);
+  if (!(first <= last)) return;
+
+  for (int u = (int) first; u <= (int) last; u++) {
+    double span = std::min(u + 1.0, u1) - std::max((double) u, u0);
+    double top = v0 + (u + 0.5 - u0) * slope - 0.5;
+    double row = floor(top), frac = top - row;
+    if (!(row >= clipV0 - 1 && row < clipV1)) continue;
+    for (int i = 0; i < 2; i++) {
+      int v = (int) row + i;
+      if (v < clipV0 || v >= clipV1) continue;
+      Color c = color;
+      c.a *= span * (i ? frac : 1 - frac);
+      if (c.a <= 0) continue;
+
+      // every sample of pixel (u,v), or (v,u) for a y-major line
+      int px = xMajor ? u : v, py = xMajor ? v : u;
+      for (int y = py * sqrtSR; y < (py + 1) * sqrtSR; y++)
+        fill_span(px * sqrtSR, (px + 1) * sqrtSR - 1, y, c, clip);
+    }
+  }
+}
+
+/**
+ * Edge function of the directed edge p->q,
+ *   E(x,y) = (x - px)*(qy - py) - (y - py)*(qx - px).
+ * Every edge is evaluated from its lexicographically smaller endpoint, so two
+ * triangles sharing an edge compute bitwise opposite values along it and the
+ * inclusive inside test leaves no cracks between them.
+ */
+struct EdgeFunction {
+  double px, py, ex, ey;
+  double sign, step_x, step_y;
+  double tol; // bound on the rounding error of values inside the bbox
+  double bias; // subtracted from every value, to break ties on the edge
+
+  void init( double x0, double y0, double x1, double y1 ) {
+    sign = 1;
+    if (x1 < x0 || (x1 == x0 && y1 < y0)) {
+      std::swap(x0, x1); std::swap(y0, y1);
+      sign = -1;
+    }
+    px = x0; py = y0;
+    ex = x1 - x0; ey = y1 - y0;
+    bias = 0;
+    step_x =  sign * ey;
+    step_y = -sign * ex;
+  }
+
+  void flip() { sign = -sign; step_x = -step_x; step_y = -step_y; }
+
+  double eval( double x, double y ) const {
+    return sign * ((x - px)*ey - (y - py)*ex) - bias;
+  }
+};
+
+// The traversal walks the bounding box in aligned blocks of kBlockSize x
+// kBlockSize samples, grouped into coarse blocks of kCoarseBlockSize. Each
+// row of a block re-evaluates the edge functions exactly at the block's
+// left column and steps with adds from there. Anchoring to the sample grid
+// rather than to the bounding box keeps the stepping error small and makes
+// every sample's value independent of the triangle's extent, so abutting
+// triangles agree on their shared edge. Tiles start on block boundaries
+// too, so clipping to a tile changes nothing either.
+static const int kBlockSize = 8;
+static const int kCoarseBlockSize = 64;
+
+// Snapped vertices lie on a grid of 1/kSubpixel samples (8 fractional
+// bits). Edge values of sample centers are then multiples of
+// 1/kSubpixel^2, and as long as vertices stay within kSnapLimit samples of
+// the origin they fit in a double's mantissa, so every evaluation, step
+// and comparison is exact.
+static const double kSubpixel = 256;
+static const double kSnapLimit = 65536;
+
+/**
+ * Per-triangle setup for the edge-function rasterizer: the three edge
+ * functions, oriented so that the inside is non-negative, the reciprocal of
+ * the doubled area used to turn them into barycentrics, and the sample
+ * bounding box. Returns false for triangles that cover no samples.
+ */
+struct TriangleSetup {
+  EdgeFunction e[3]; // e[i] is the edge opposite vertex i
+  double offset[3][kBlockSize]; // k * e[i].step_x, for sample k of a block row
+  double invArea;
+  int minX, maxX, minY, maxY;
+
+  // For a piece of a triangle clipped to the guard band, the barycentrics
+  // (l0,l1) of the piece map to bary0 + l0*baryU + l1*baryV in the
+  // triangle that is being shaded.
+  bool remapped;
+  Vector2D bary0, baryU, baryV;
+};
+
+static bool setup_triangle( TriangleSetup &ts,
+                            double x0, double y0,
+                            double x1, double y1,
+                            double x2, double y2,
+                            int clipX0, int clipY0, int clipX1, int clipY1,
+                            bool snap, double minOffset ) {
+  ts.remapped = false;
+
+  // triangles too far out for exact fixed point keep their float vertices
+  double extent = std::max(std::max(std::abs(x0), std::abs(y0)),
+                           std::max(std::max(std::abs(x1), std::abs(y1)),
+                                    std::max(std::abs(x2), std::abs(y2))));
+  snap = snap && extent < kSnapLimit;
+  if (snap) {
+    x0 = floor(x0 * kSubpixel + 0.5) / kSubpixel; y0 = floor(y0 * kSubpixel + 0.5) / kSubpixel;
+    x1 = floor(x1 * kSubpixel + 0.5) / kSubpixel; y1 = floor(y1 * kSubpixel + 0.5) / kSubpixel;
+    x2 = floor(x2 * kSubpixel + 0.5) / kSubpixel; y2 = floor(y2 * kSubpixel + 0.5) / kSubpixel;
+  }
+
+  // Sample (sx,sy) sits at (sx+.5, sy+.5), or for patterns other than
+  // ordered grids, cell (sx,sy) has samples at offsets in [minOffset,1);
+  // keep the cells with samples inside the bounding box and the clip
+  // rectangle. Triangles whose bounding box holds no sample, like most
+  // slivers and specks, are rejected here before any edge setup; so are
+  // NaN vertices.
+  double left = std::min(x0, std::min(x1, x2)), right = std::max(x0, std::max(x1, x2));
+  double top = std::min(y0, std::min(y1, y2)), bottom = std::max(y0, std::max(y1, y2));
+  double minX = std::max(minOffset > 0 ? ceil(left - minOffset) : floor(left), (double) clipX0);
+  double maxX = std::min(floor(right - minOffset), clipX1 - 1.0);
+  double minY = std::max(minOffset > 0 ? ceil(top - minOffset) : floor(top), (double) clipY0);
+  double maxY = std::min(floor(bottom - minOffset), clipY1 - 1.0);
+  if (!(minX <= maxX && minY <= maxY)) return false;
+  ts.minX = (int) minX; ts.maxX = (int) maxX;
+  ts.minY = (int) minY; ts.maxY = (int) maxY;
+
+  // zero-area triangles cover nothing, and would make the barycentrics
+  // divide by zero
+  ts.e[0].init(x1, y1, x2, y2);
+  ts.e[1].init(x2, y2, x0, y0);
+  ts.e[2].init(x0, y0, x1, y1);
+
+  double area = ts.e[2].eval(x2, y2);
+  if (area == 0 || area != area) return false;
+  if (area < 0) {
+    for (int i = 0; i < 3; i++) ts.e[i].flip();
+    area = -area;
+  }
+  ts.invArea = 1 / area;
+
+  // Evaluating and stepping an edge function each round off by a few ulps
+  // of the largest term involved anywhere in the blocks covering the bbox;
+  // 1e-12 of it is a comfortable bound. Snapped edges are exact instead,
+  // and apply the top-left rule: a sample exactly on an edge belongs to the
+  // triangle only if the edge is a left edge (inside lies towards +x) or a
+  // horizontal top edge (inside lies towards +y). The two triangles sharing
+  // an edge see it with opposite normals, so exactly one of them owns it.
+  for (int i = 0; i < 3; i++) {
+    EdgeFunction &e = ts.e[i];
+    if (snap) {
+      e.tol = 0;
+      bool topLeft = e.step_x > 0 || (e.step_x == 0 && e.step_y > 0);
+      e.bias = topLeft ? 0 : 1 / (kSubpixel * kSubpixel);
+    } else {
+      double dx = std::max(std::abs(ts.minX - kCoarseBlockSize - e.px),
+                           std::abs(ts.maxX + kCoarseBlockSize - e.px));
+      double dy = std::max(std::abs(ts.minY - kCoarseBlockSize - e.py),
+                           std::abs(ts.maxY + kCoarseBlockSize - e.py));
+      e.tol = 1e-12 * (dx * std::abs(e.ey) + dy * std::abs(e.ex));
+    }
+    for (int k = 0; k < kBlockSize; k++)
+      ts.offset[i][k] = k * e.step_x;
+  }
+  return true;
+}
+
+enum BlockCoverage { BLOCK_OUTSIDE, BLOCK_PARTIAL, BLOCK_INSIDE };
+
+/**
+ * Classifies the size x size block of samples at (bx,by) as entirely
+ * outside the triangle, entirely inside, or neither. The edge functions are
+ * linear, so over the block's sample centers each takes its extremes on
+ * opposite corners; testing those against the rounding tolerance makes the
+ * answer agree with what the per-sample test would decide.
+ */
+static BlockCoverage classify_block( const TriangleSetup &ts, int bx, int by, int size ) {
+  double lo_x = bx + 0.5, hi_x = bx + size - 0.5;
+  double lo_y = by + 0.5, hi_y = by + size - 0.5;
+
+  BlockCoverage coverage = BLOCK_INSIDE;
+  for (int i = 0; i < 3; i++) {
+    const EdgeFunction &e = ts.e[i];
+    double min_x = e.step_x >= 0 ? lo_x : hi_x, max_x = e.step_x >= 0 ? hi_x : lo_x;
+    double min_y = e.step_y >= 0 ? lo_y : hi_y, max_y = e.step_y >= 0 ? hi_y : lo_y;
+    if (e.eval(max_x, max_y) < -e.tol) return BLOCK_OUTSIDE;
+    if (e.eval(min_x, min_y) <= e.tol) coverage = BLOCK_PARTIAL;
+  }
+  return coverage;
+}
+
+/**
+ * Blends color into the cells x0..x1 (inclusive) of row y of the sample
+ * grid, that is into all of their samples in clip's buffer, without any
+ * further bounds checks. Does the same arithmetic as blend_sample; an
+ * opaque color just replaces the samples.
+ */
+void DrawRend::fill_span( int x0, int x1, int y, Color color, const SampleRect &clip ) {
+  unsigned char *p = cell(clip, x0, y);
+  int n = cell_samples * (x1 - x0 + 1);
+  if (linear) {
+    SampleSource src = sample_source(color, true);
+    for (int i = 0; i < n; i++, p += sample_size)
+      blend_sample(p, src);
+    return;
+  }
+  uint32_t src = premultiply(color);
+  if (kernels) {
+    kernels->blend_span(p, n, src);
+    return;
+  }
+  bool opaque = (src >> 24) == 255;
+  for (int i = 0; i < n; i++, p += 4) {
+    uint32_t d = src;
+    if (!opaque) {
+      memcpy(&d, p, 4);
+      d = blend_over(d, src);
+    }
+    memcpy(p, &d, 4);
+  }
+}
+
+// Triangles reaching further than kGuardBand samples beyond the buffer are
+// clipped to the guard band before setup. Nothing beyond the band is ever
+// visible, and keeping vertices close bounds the magnitude of the edge
+// functions, so their tolerances stay tight and snapping stays exact at any
+// zoom. The band is wide enough that ordinary scenes are never clipped.
+static const double kGuardBand = 8192;
+
+// a vertex of a triangle being clipped, with its barycentrics in the
+// original triangle
+struct ClipVertex {
+  double x, y;
+  Vector2D bary;
+};
+
+/**
+ * Intersects the segment ab with the line where coordinate axis (0 for x,
+ * 1 for y) equals bound. The result does not depend on the order of a and
+ * b, so triangles sharing the edge agree on where it is cut.
+ */
+static ClipVertex clip_intersect( ClipVertex a, ClipVertex b, int axis, double bound ) {
+  if (b.x < a.x || (b.x == a.x && b.y < a.y)) std::swap(a, b);
+  double pa = axis ? a.y : a.x, pb = axis ? b.y : b.x;
+  double t = (bound - pa) / (pb - pa);
+  ClipVertex r;
+  r.x = axis ? a.x + t * (b.x - a.x) : bound;
+  r.y = axis ? bound : a.y + t * (b.y - a.y);
+  r.bary = a.bary + t * (b.bary - a.bary);
+  return r;
+}
+
+/**
+ * Sutherland-Hodgman step: clips the convex polygon in[0..n-1] to the half
+ * plane side * (coordinate axis - bound) <= 0, writing the result to out and
+ * returning its vertex count.
+ */
+static int clip_polygon( const ClipVertex *in, int n, ClipVertex *out,
+                         int axis, double side, double bound ) {
+  int m = 0;
+  for (int i = 0; i < n; i++) {
+    const ClipVertex &a = in[i], &b = in[(i + 1) % n];
+    bool aIn = side * ((axis ? a.y : a.x) - bound) <= 0;
+    bool bIn = side * ((axis ? b.y : b.x) - bound) <= 0;
+    if (aIn) out[m++] = a;
+    if (aIn != bIn) out[m++] = clip_intersect(a, b, axis, bound);
+  }
+  return m;
+}
+
+/**
+ * Shaders for the specialized triangle kernels. Each shades a 2x2 quad of
+ * samples from their barycentric coordinates, like Triangle::color_quad,
+ * with the triangle type and sampling methods fixed at compile time. Flat
+ * shaders blend the triangle's color and skip barycentrics.
+ */
+struct FlatShader {
+  static const bool flat = true;
+  FlatShader( Triangle *tri, const SampleParams &sp ) { }
+  void shade_quad( const Vector2D xy[4], unsigned mask, Color out[4] ) const { }
+};
+
+struct ColorTriShader {
+  static const bool flat = false;
+  ColorTri *tri;
+  ColorTriShader( Triangle *tri, const SampleParams &sp )
+    : tri(static_cast<ColorTri *>(tri)) { }
+  void shade_quad( const Vector2D xy[4], unsigned mask, Color out[4] ) const {
+    for (int i = 0; i < 4; i++)
+      if (mask & (1 << i))
+        out[i] = tri->ColorTri::color(xy[i]);
+  }
+};
+
+template <PixelSampleMethod psm, LevelSampleMethod lsm>
+struct TexTriShader {
+  static const bool flat = false;
+  TexTri *tri;
+  TexTriShader( Triangle *tri, const SampleParams &sp )
+    : tri(static_cast<TexTri *>(tri)) { }
+  void shade_quad( const Vector2D xy[4], unsigned mask, Color out[4] ) const {
+    SampleParams sp[4];
+    tri->quad_params(sp, xy);
+    for (int i = 0; i < 4; i++)
+      if (mask & (1 << i))
+        out[i] = tri->tex->sample<psm, lsm>(sp[i]);
+  }
+};
+
+// any other Triangle: goes through the virtual color_quad()
+struct VirtualShader {
+  static const bool flat = false;
+  Triangle *tri;
+  SampleParams sp;
+  VirtualShader( Triangle *tri, const SampleParams &sp ) : tri(tri), sp(sp) { }
+  void shade_quad( const Vector2D xy[4], unsigned mask, Color out[4] ) const {
+    tri->color_quad(xy, mask, out, sp);
+  }
+};
+
+// indices of DrawRend::triangle_kernels and columns of the msaa and
+// pattern kernel tables
+enum ShaderKind { SHADE_FLAT = 0, SHADE_COLOR = 1, SHADE_TEXTURE = 2, SHADE_VIRTUAL = 8 };
+
+static int shader_kind( Triangle *tri, PixelSampleMethod psm, LevelSampleMethod lsm ) {
+  if (tri == NULL) return SHADE_FLAT;
+  if (dynamic_cast<ColorTri *>(tri)) return SHADE_COLOR;
+  if (dynamic_cast<TexTri *>(tri)) return SHADE_TEXTURE + 3 * psm + lsm;
+  return SHADE_VIRTUAL;
+}
+
+// coverage of the kBlockSize samples of a block row whose edge values at
+// its first sample are row[0..2]; bit k stands for sample k
+static inline unsigned row_coverage( const TriangleSetup &ts, const RasterKernels *kernels,
+                                     const double row[3] ) {
+  if (kernels) return kernels->coverage8(row, ts.offset);
+  unsigned mask = 0;
+  for (int k = 0; k < kBlockSize; k++)
+    if (row[0] + ts.offset[0][k] >= 0 && row[1] + ts.offset[1][k] >= 0 &&
+        row[2] + ts.offset[2][k] >= 0)
+      mask |= 1 << k;
+  return mask;
+}
+
+template <class Shader>
+void DrawRend::rasterize_triangle_kernel( const TriangleSetup &ts, Color color,
+                                          Triangle *tri, const SampleRect &clip ) {
+  SampleParams sp = SampleParams();
+  sp.psm = psm;
+  sp.lsm = lsm;
+  const Shader shader(tri, sp);
+  const int stride = clip.stride;
+
+  // flat color premultiplied as blend_sample does, for the blend kernels
+  SampleSource src = sample_source(color, linear);
+
+  for (int cy = ts.minY & ~(kCoarseBlockSize - 1); cy <= ts.maxY; cy += kCoarseBlockSize) {
+    for (int cx = ts.minX & ~(kCoarseBlockSize - 1); cx <= ts.maxX; cx += kCoarseBlockSize) {
+      BlockCoverage coarse = classify_block(ts, cx, cy, kCoarseBlockSize);
+      if (coarse == BLOCK_OUTSIDE) continue;
+
+      int coarseX0 = std::max(cx, ts.minX), coarseX1 = std::min(cx + kCoarseBlockSize - 1, ts.maxX);
+      int coarseY0 = std::max(cy, ts.minY), coarseY1 = std::min(cy + kCoarseBlockSize - 1, ts.maxY);
+      if (hidden(clip, coarseX0, coarseY0, coarseX1, coarseY1)) continue;
+      if (coarse == BLOCK_INSIDE && Shader::flat) {
+        // fill the runs of blocks that are not hidden
+        for (int by = coarseY0 & ~(kBlockSize - 1); by <= coarseY1; by += kBlockSize) {
+          int runY0 = std::max(by, coarseY0), runY1 = std::min(by + kBlockSize - 1, coarseY1);
+          for (int runX0 = coarseX0; runX0 <= coarseX1; ) {
+            int runX1 = runX0;
+            while (runX1 <= coarseX1 && !hidden(clip, runX1, runY0, runX1, runY1))
+              runX1 = (runX1 & ~(kBlockSize - 1)) + kBlockSize;
+            if (runX1 > runX0)
+              for (int sy = runY0; sy <= runY1; sy++)
+                fill_span(runX0, std::min(runX1, coarseX1 + 1) - 1, sy, color, clip);
+            runX0 = (runX1 & ~(kBlockSize - 1)) + kBlockSize;
+          }
+        }
+        continue;
+      }
+
+      for (int by = coarseY0 & ~(kBlockSize - 1); by <= coarseY1; by += kBlockSize) {
+        for (int bx = coarseX0 & ~(kBlockSize - 1); bx <= coarseX1; bx += kBlockSize) {
+          BlockCoverage fine = coarse;
+          if (fine == BLOCK_PARTIAL)
+            fine = classify_block(ts, bx, by, kBlockSize);
+          if (fine == BLOCK_OUTSIDE) continue;
+
+          int blockX0 = std::max(bx, ts.minX), blockX1 = std::min(bx + kBlockSize - 1, ts.maxX);
+          int blockY0 = std::max(by, ts.minY), blockY1 = std::min(by + kBlockSize - 1, ts.maxY);
+          if (hidden(clip, blockX0, blockY0, blockX1, blockY1)) continue;
+          if (fine == BLOCK_INSIDE && Shader::flat) {
+            for (int sy = blockY0; sy <= blockY1; sy++)
+              fill_span(blockX0, blockX1, sy, color, clip);
+            continue;
+          }
+
+          // samples bx+k with k outside [blockX0-bx, blockX1-bx] are clipped
+          unsigned span = (0xFFu << (blockX0 - bx)) & (0xFFu >> (bx + kBlockSize - 1 - blockX1));
+          // whole block rows inside the clip rectangle may be loaded and
+          // stored as a unit, the unselected samples written back unchanged
+          bool wholeRow = kernels && !linear && bx >= clip.x0 && bx + kBlockSize <= clip.x1;
+
+          if (Shader::flat) {
+            for (int sy = blockY0; sy <= blockY1; sy++) {
+              double x = bx + 0.5, y = sy + 0.5;
+              double row[3] = { ts.e[0].eval(x, y), ts.e[1].eval(x, y), ts.e[2].eval(x, y) };
+              unsigned mask = fine == BLOCK_INSIDE ? span : row_coverage(ts, kernels, row) & span;
+              if (!mask) continue;
+
+              unsigned char *p = cell(clip, bx, sy);
+              if (wholeRow) {
+                kernels->blend8(p, mask, src.packed);
+              } else {
+                for (int k = 0; k < kBlockSize; k++)
+                  if (mask & (1 << k))
+                    blend_sample(p + sample_size * k, src);
+              }
+            }
+            continue;
+          }
+
+          // Shade in 2x2 quads aligned to even samples, so that the shader
+          // can take derivatives from the neighbours. Samples of a quad
+          // outside the triangle or the block still get barycentrics, but
+          // are neither shaded nor written.
+          for (int qy = blockY0 & ~1; qy <= blockY1; qy += 2) {
+            double x = bx + 0.5;
+            double rows[2][3];
+            unsigned masks[2];
+            for (int r = 0; r < 2; r++) {
+              int sy = qy + r;
+              double y = sy + 0.5;
+              for (int i = 0; i < 3; i++)
+                rows[r][i] = ts.e[i].eval(x, y);
+              if (sy < blockY0 || sy > blockY1) masks[r] = 0;
+              else if (fine == BLOCK_INSIDE) masks[r] = span;
+              else masks[r] = row_coverage(ts, kernels, rows[r]) & span;
+            }
+            if (!(masks[0] | masks[1])) continue;
+
+            for (int k = 0; k < kBlockSize; k += 2) {
+              unsigned quad = ((masks[0] >> k) & 3) | ((masks[1] >> k) & 3) << 2;
+              if (!quad) continue;
+
+              Vector2D xy[4];
+              for (int i = 0; i < 4; i++) {
+                const double *row = rows[i >> 1];
+                int sk = k + (i & 1);
+                xy[i] = Vector2D((row[0] + ts.offset[0][sk]) * ts.invArea,
+                                 (row[1] + ts.offset[1][sk]) * ts.invArea);
+                if (ts.remapped)
+                  xy[i] = ts.bary0 + xy[i].x * ts.baryU + xy[i].y * ts.baryV;
+              }
+              Color out[4];
+              shader.shade_quad(xy, quad, out);
+
+              unsigned char *p = cell(clip, bx + k, qy);
+              for (int i = 0; i < 4; i++)
+                if (quad & (1 << i))
+                  blend_sample(p + (i >> 1) * stride + sample_size * (i & 1), out[i], linear);
+            }
+          }
+        }
+      }
     }
-    float slope = (blowupY1 - blowupY0)/(blowupX1 - blowupX0);
-    do {
-      for (int i = 0; i < sqrtSR; i++){
-        this->DrawRend::rasterize_point(blowupX0 + i, blowupY0, color);
+  }
+}
+
+/**
+ * Multisampled counterpart of rasterize_triangle_kernel. Coverage is still
+ * decided per sample, with the same arithmetic, so edges come out exactly
+ * as supersampled; but the shader runs once per covered pixel, at its
+ * center, and its color is blended into the pixel's covered samples.
+ * Pixels are shaded in 2x2 quads aligned to even pixels, so derivatives
+ * are taken between pixel centers. Tiles start on even pixels, so a quad
+ * never straddles two tiles.
+ */
+template <int kSqrtSR, class Shader>
+void DrawRend::rasterize_triangle_msaa( const TriangleSetup &ts, Color color,
+                                        Triangle *tri, const SampleRect &clip ) {
+  // a flat color is the same per pixel as per sample
+  if (Shader::flat) {
+    rasterize_triangle_kernel<Shader>(ts, color, tri, clip);
+    return;
+  }
+
+  SampleParams sp = SampleParams();
+  sp.psm = psm;
+  sp.lsm = lsm;
+  const Shader shader(tri, sp);
+  const int stride = clip.stride;
+  const int kQuadSize = 2 * kSqrtSR; // samples across a quad of pixels
+  const unsigned kPixelRow = (1u << kSqrtSR) - 1;
+
+  for (int qy = ts.minY / kQuadSize * kQuadSize; qy <= ts.maxY; qy += kQuadSize) {
+    for (int qx = ts.minX / kQuadSize * kQuadSize; qx <= ts.maxX; qx += kQuadSize) {
+      BlockCoverage coverage = classify_block(ts, qx, qy, kQuadSize);
+      if (coverage == BLOCK_OUTSIDE) continue;
+
+      // samples qx+c with c outside [lo,hi] are clipped
+      int lo = std::max(ts.minX - qx, 0), hi = std::min(ts.maxX - qx, kQuadSize - 1);
+      if (hidden(clip, qx + lo, std::max(qy, ts.minY),
+                       qx + hi, std::min(qy + kQuadSize - 1, ts.maxY))) continue;
+      unsigned span = ((2u << hi) - 1) & ~((1u << lo) - 1);
+
+      // sample masks of the quad's pixels; bit r*kSqrtSR+c of pixels[i]
+      // is the sample in row r and column c of pixel i
+      unsigned pixels[4] = { 0, 0, 0, 0 };
+      for (int r = 0; r < kQuadSize; r++) {
+        int sy = qy + r;
+        if (sy < ts.minY || sy > ts.maxY) continue;
+
+        // gather the row from the aligned blocks the per-sample path uses,
+        // so that every sample is tested with the same edge values
+        unsigned row = span;
+        if (coverage == BLOCK_PARTIAL) {
+          row = 0;
+          for (int bx = qx & ~(kBlockSize - 1); bx < qx + kQuadSize; bx += kBlockSize) {
+            double x = bx + 0.5, y = sy + 0.5;
+            double values[3] = { ts.e[0].eval(x, y), ts.e[1].eval(x, y), ts.e[2].eval(x, y) };
+            unsigned mask = row_coverage(ts, kernels, values);
+            row |= bx >= qx ? mask << (bx - qx) : mask >> (qx - bx);
+          }
+          row &= span;
+        }
+        for (int px = 0; px < 2; px++)
+          pixels[(r / kSqrtSR) * 2 + px] |=
+            ((row >> (px * kSqrtSR)) & kPixelRow) << ((r % kSqrtSR) * kSqrtSR);
+      }
+
+      unsigned quad = 0;
+      for (int i = 0; i < 4; i++)
+        if (pixels[i]) quad |= 1 << i;
+      if (!quad) continue;
+
+      Vector2D xy[4];
+      for (int i = 0; i < 4; i++) {
+        double x = qx + (i & 1) * kSqrtSR + kSqrtSR * 0.5;
+        double y = qy + (i >> 1) * kSqrtSR + kSqrtSR * 0.5;
+        xy[i] = Vector2D(ts.e[0].eval(x, y) * ts.invArea, ts.e[1].eval(x, y) * ts.invArea);
+        if (ts.remapped)
+          xy[i] = ts.bary0 + xy[i].x * ts.baryU + xy[i].y * ts.baryV;
+      }
+      Color out[4];
+      shader.shade_quad(xy, quad, out);
+
+      for (int i = 0; i < 4; i++) {
+        if (!pixels[i]) continue;
+        unsigned char *p = cell(clip, qx + (i & 1) * kSqrtSR, qy + (i >> 1) * kSqrtSR);
+        for (int k = 0; k < kSqrtSR * kSqrtSR; k++)
+          if (pixels[i] & (1 << k))
+            blend_sample(p + (k / kSqrtSR) * stride + sample_size * (k % kSqrtSR), out[i], linear);
       }
-      blowupY0 += 1;
-      blowupX0 += (1/slope);
-    }while (blowupY0 < blowupY1);
+    }
   }
+}
 
+// coverage of kSamples samples whose edge values are corner[e] + delta[e][k];
+// bit k stands for sample k
+template <int kSamples>
+static inline unsigned pattern_coverage( const double corner[3],
+                                         const double delta[3][kSamples] ) {
+  unsigned mask = 0;
+  for (int k = 0; k < kSamples; k++)
+    if (corner[0] + delta[0][k] >= 0 && corner[1] + delta[1][k] >= 0 &&
+        corner[2] + delta[2][k] >= 0)
+      mask |= 1 << k;
+  return mask;
 }
 
+/**
+ * Triangle traversal for sample patterns that are not ordered grids. The
+ * sample grid is then the pixel grid: pixel (x,y) keeps its kSamples
+ * samples side by side, sample k sitting at (x,y) plus the pattern's offset
+ * k. Coverage is tested per sample from the edge values at the pixel's
+ * corner. Runs of fully covered pixels of a flat triangle are filled as
+ * spans; shaded triangles are shaded once per pixel in 2x2 quads and
+ * written to the covered samples, as in rasterize_triangle_msaa.
+ */
+template <int kSamples, class Shader>
+void DrawRend::rasterize_triangle_pattern( const TriangleSetup &ts, Color color,
+                                           Triangle *tri, const SampleRect &clip ) {
+  SampleParams sp = SampleParams();
+  sp.psm = psm;
+  sp.lsm = lsm;
+  const Shader shader(tri, sp);
+  const unsigned kAll = (1u << kSamples) - 1;
+
+  // edge values of the samples relative to their pixel's corner
+  const SamplePattern &pat = sample_patterns[pattern];
+  double delta[3][kSamples];
+  for (int i = 0; i < 3; i++)
+    for (int k = 0; k < kSamples; k++)
+      delta[i][k] = pat.offsets[k][0] * ts.e[i].step_x + pat.offsets[k][1] * ts.e[i].step_y;
+
+  if (Shader::flat) {
+    SampleSource src = sample_source(color, linear);
+    for (int y = ts.minY; y <= ts.maxY; y++) {
+      int run = -1; // first pixel of the current run of covered pixels
+      for (int x = ts.minX; x <= ts.maxX + 1; x++) {
+        unsigned mask = 0;
+        if (x <= ts.maxX) {
+          double corner[3] = { ts.e[0].eval(x, y), ts.e[1].eval(x, y), ts.e[2].eval(x, y) };
+          mask = pattern_coverage<kSamples>(corner, delta);
+        }
+        if (mask == kAll) {
+          if (run < 0) run = x;
+          continue;
+        }
+        if (run >= 0) {
+          fill_span(run, x - 1, y, color, clip);
+          run = -1;
+        }
+        unsigned char *p = cell(clip, x, y);
+        for (int k = 0; k < kSamples; k++)
+          if (mask & (1 << k))
+            blend_sample(p + sample_size * k, src);
+      }
+    }
+    return;
+  }
+
+  for (int qy = ts.minY & ~1; qy <= ts.maxY; qy += 2) {
+    for (int qx = ts.minX & ~1; qx <= ts.maxX; qx += 2) {
+      unsigned pixels[4], quad = 0;
+      for (int i = 0; i < 4; i++) {
+        int x = qx + (i & 1), y = qy + (i >> 1);
+        pixels[i] = 0;
+        if (x < ts.minX || x > ts.maxX || y < ts.minY || y > ts.maxY) continue;
+        double corner[3] = { ts.e[0].eval(x, y), ts.e[1].eval(x, y), ts.e[2].eval(x, y) };
+        pixels[i] = pattern_coverage<kSamples>(corner, delta);
+        if (pixels[i]) quad |= 1 << i;
+      }
+      if (!quad) continue;
+
+      Vector2D xy[4];
+      for (int i = 0; i < 4; i++) {
+        double x = qx + (i & 1) + 0.5, y = qy + (i >> 1) + 0.5;
+        xy[i] = Vector2D(ts.e[0].eval(x, y) * ts.invArea, ts.e[1].eval(x, y) * ts.invArea);
+        if (ts.remapped)
+          xy[i] = ts.bary0 + xy[i].x * ts.baryU + xy[i].y * ts.baryV;
+      }
+      Color out[4];
+      shader.shade_quad(xy, quad, out);
+
+      for (int i = 0; i < 4; i++) {
+        unsigned char *p = cell(clip, qx + (i & 1), qy + (i >> 1));
+        for (int k = 0; k < kSamples; k++)
+          if (pixels[i] & (1 << k))
+            blend_sample(p + sample_size * k, out[i], linear);
+      }
+    }
+  }
+}
+
+#define TRIANGLE_KERNELS(kernel, n) { \
+  &DrawRend::kernel<n, FlatShader>, \
+  &DrawRend::kernel<n, ColorTriShader>, \
+  &DrawRend::kernel<n, TexTriShader<P_NEAREST, L_ZERO> >, \
+  &DrawRend::kernel<n, TexTriShader<P_NEAREST, L_NEAREST> >, \
+  &DrawRend::kernel<n, TexTriShader<P_NEAREST, L_LINEAR> >, \
+  &DrawRend::kernel<n, TexTriShader<P_LINEAR, L_ZERO> >, \
+  &DrawRend::kernel<n, TexTriShader<P_LINEAR, L_NEAREST> >, \
+  &DrawRend::kernel<n, TexTriShader<P_LINEAR, L_LINEAR> >, \
+  &DrawRend::kernel<n, VirtualShader> }
+
+const DrawRend::TriangleKernel DrawRend::triangle_kernels[kNumShaders] = {
+  &DrawRend::rasterize_triangle_kernel<FlatShader>,
+  &DrawRend::rasterize_triangle_kernel<ColorTriShader>,
+  &DrawRend::rasterize_triangle_kernel<TexTriShader<P_NEAREST, L_ZERO> >,
+  &DrawRend::rasterize_triangle_kernel<TexTriShader<P_NEAREST, L_NEAREST> >,
+  &DrawRend::rasterize_triangle_kernel<TexTriShader<P_NEAREST, L_LINEAR> >,
+  &DrawRend::rasterize_triangle_kernel<TexTriShader<P_LINEAR, L_ZERO> >,
+  &DrawRend::rasterize_triangle_kernel<TexTriShader<P_LINEAR, L_NEAREST> >,
+  &DrawRend::rasterize_triangle_kernel<TexTriShader<P_LINEAR, L_LINEAR> >,
+  &DrawRend::rasterize_triangle_kernel<VirtualShader>
+};
+
+const DrawRend::TriangleKernel DrawRend::msaa_kernels[3][kNumShaders] = {
+  TRIANGLE_KERNELS(rasterize_triangle_msaa, 2),
+  TRIANGLE_KERNELS(rasterize_triangle_msaa, 3),
+  TRIANGLE_KERNELS(rasterize_triangle_msaa, 4)
+};
+
+const DrawRend::TriangleKernel DrawRend::pattern_kernels[3][kNumShaders] = {
+  TRIANGLE_KERNELS(rasterize_triangle_pattern, 2),
+  TRIANGLE_KERNELS(rasterize_triangle_pattern, 4),
+  TRIANGLE_KERNELS(rasterize_triangle_pattern, 8)
+};
+
+#undef TRIANGLE_KERNELS
+
   // rasterize a triangle
 void DrawRend::rasterize_triangle( float x0, float y0,
                          float x1, float y1,
                          float x2, float y2,
                          Color color, Triangle *tri) {
-  // Part 2: Fill in this function with basic triangle rasterization code
-  float sqrtSR = sqrt(sample_rate);
-  float blowupX0 = sqrtSR*x0;
-  float blowupY0 = sqrtSR*y0;
-  float blowupX1 = sqrtSR*x1;
-  float blowupY1 = sqrtSR*y1;
-  float blowupX2 = sqrtSR*x2;
-  float blowupY2 = sqrtSR*y2;
+  if (recording) {
+    RasterCommand cmd = { RasterCommand::CMD_TRIANGLE, x0, y0, x1, y1, x2, y2, color, tri };
+    record(cmd);
+  } else {
+    rasterize_triangle(x0, y0, x1, y1, x2, y2, color, tri, buffer_rect());
+  }
+}
 
-  float minX = std::min(blowupX0, std::min(blowupX1, blowupX2));
-  float maxX = std::max(blowupX0, std::max(blowupX1, blowupX2));
-  float minY = std::min(blowupY0, std::min(blowupY1, blowupY2));
-  float maxY = std::max(blowupY0, std::max(blowupY1, blowupY2));
-  SampleParams sp = SampleParams();
-  sp.psm = psm;
-  sp.lsm = lsm;
+void DrawRend::rasterize_triangle( float x0, float y0,
+                         float x1, float y1,
+                         float x2, float y2,
+                         Color color, Triangle *tri,
+                         const SampleRect &clip) {
+  int kind = shader_kind(tri, psm, lsm);
+  TriangleKernel kernel = msaa && sqrt_sample_rate > 1 ?
+                          msaa_kernels[sqrt_sample_rate - 2][kind] :
+                          triangle_kernels[kind];
+  if (cell_samples > 1)
+    kernel = pattern_kernels[cell_samples == 2 ? 0 : cell_samples == 4 ? 1 : 2][kind];
+
+  TriangleSetup ts[kMaxPieces];
+  int pieces = setup_pieces(x0, y0, x1, y1, x2, y2, clip, ts);
+  for (int i = 0; i < pieces; i++) {
+    int samples = (ts[i].maxX - ts[i].minX + 1) * (ts[i].maxY - ts[i].minY + 1);
+    if (kind == SHADE_FLAT && cell_samples == 1 && samples <= kMicroSamples)
+      rasterize_triangle_micro(ts[i], color, clip);
+    else
+      (this->*kernel)(ts[i], color, tri, clip);
+  }
+}
 
+/**
+ * Rasterizes a flat triangle whose bounding box holds only a few samples
+ * by testing just those, skipping the block classification. The edge
+ * values are computed as the block traversal computes them, from the
+ * aligned block's first column, so the same samples are covered.
+ */
+void DrawRend::rasterize_triangle_micro( const TriangleSetup &ts, Color color,
+                                         const SampleRect &clip ) {
+  SampleSource src = sample_source(color, linear);
+  for (int sy = ts.minY; sy <= ts.maxY; sy++) {
+    double y = sy + 0.5;
+    int bx = -1;
+    double row[3] = { 0, 0, 0 };
+    for (int sx = ts.minX; sx <= ts.maxX; sx++) {
+      if ((sx & ~(kBlockSize - 1)) != bx) {
+        bx = sx & ~(kBlockSize - 1);
+        for (int i = 0; i < 3; i++)
+          row[i] = ts.e[i].eval(bx + 0.5, y);
+      }
+      int k = sx - bx;
+      if (row[0] + ts.offset[0][k] >= 0 && row[1] + ts.offset[1][k] >= 0 &&
+          row[2] + ts.offset[2][k] >= 0)
+        blend_sample(cell(clip, sx, sy), src);
+    }
+  }
+}
 
+/**
+ * Sets up the triangle with vertices in pixels for rasterization within
+ * clip, as the pieces ts[0..n) it returns the number n of: the triangle
+ * itself, or the fan of the convex polygon it leaves when clipped to the
+ * guard band, every piece shaded with the barycentrics of the whole.
+ */
+int DrawRend::setup_pieces( float x0, float y0, float x1, float y1,
+                            float x2, float y2, const SampleRect &clip,
+                            TriangleSetup *ts ) {
+  float sqrtSR = sqrt_sample_rate;
+  double minOffset = cell_samples > 1 ? 0 : 0.5;
+
+  ClipVertex v[3] = {
+    { sqrtSR*x0, sqrtSR*y0, Vector2D(1, 0) },
+    { sqrtSR*x1, sqrtSR*y1, Vector2D(0, 1) },
+    { sqrtSR*x2, sqrtSR*y2, Vector2D(0, 0) }
+  };
+
+  // the guard band is placed around the buffer rather than the clip
+  // rectangle, so that every tile cuts a triangle the same way
+  SampleRect buffer = buffer_rect();
+  double bounds[4] = { buffer.x0 - kGuardBand, buffer.y0 - kGuardBand,
+                       buffer.x1 + kGuardBand, buffer.y1 + kGuardBand };
+  bool inside = true;
+  for (int i = 0; i < 3; i++)
+    inside = inside && v[i].x >= bounds[0] && v[i].y >= bounds[1] &&
+                       v[i].x <= bounds[2] && v[i].y <= bounds[3];
+
+  if (inside)
+    return setup_triangle(ts[0], v[0].x, v[0].y, v[1].x, v[1].y, v[2].x, v[2].y,
+                                 clip.x0, clip.y0, clip.x1, clip.y1, snap, minOffset);
+
+  ClipVertex poly[2][9];
+  int n = 3;
+  std::copy(v, v + 3, poly[0]);
+  for (int plane = 0; plane < 4 && n > 0; plane++)
+    n = clip_polygon(poly[plane & 1], n, poly[(plane + 1) & 1],
+                     plane & 1, plane < 2 ? -1 : 1, bounds[plane]);
+  const ClipVertex *p = poly[0];
+  int pieces = 0;
+  for (int i = 1; i + 1 < n; i++) {
+    TriangleSetup &piece = ts[pieces];
+    if (!setup_triangle(piece, p[0].x, p[0].y, p[i].x, p[i].y, p[i + 1].x, p[i + 1].y,
+                               clip.x0, clip.y0, clip.x1, clip.y1, snap, minOffset))
+      continue;
+    piece.remapped = true;
+    piece.bary0 = p[i + 1].bary;
+    piece.baryU = p[0].bary - p[i + 1].bary;
+    piece.baryV = p[i].bary - p[i + 1].bary;
+    pieces++;
+  }
+  return pieces;
+}
 
-  for (float scanY = ((int) minY + 0.5); scanY <= maxY; scanY++){
-    for (float scanX = ((int) minX + 0.5); scanX <= maxX; scanX++){
-      float alpha = ((blowupY1 - blowupY2)*(scanX - blowupX2) + (blowupX2 - blowupX1)*(scanY - blowupY2))/
-                    ((blowupY1 - blowupY2)*(blowupX0 - blowupX2) +(blowupX2 - blowupX1)*(blowupY0 - blowupY2));
-      float beta = ((blowupY2 - blowupY0)*(scanX - blowupX2) + (blowupX0 - blowupX2)*(scanY - blowupY2))/
-                   ((blowupY1 - blowupY2)*(blowupX0 - blowupX2) +(blowupX2 - blowupX1)*(blowupY0 - blowupY2));
-      float gamma = 1 - alpha - beta;
+// the samples of a block that are set in its finalized bits
+static const unsigned long long kBlockFinalized = ~0ULL;
 
-      if ((alpha >= 0 && alpha <= 1)&&(beta >= 0 && beta <= 1)&&(gamma >= 0 && gamma <= 1)){
-        if (tri != NULL) {
+/**
+ * The reverse pre-pass of occlusion culling. Walks the tile's bin from the
+ * last primitive to the first, marking the samples of every opaque one in
+ * the finalized bits; a block all of whose samples are finalized hides
+ * every primitive before the one that completed it. Opaque here means a
+ * flat triangle of alpha 1, whose blend replaces a sample whatever it held
+ * before. Samples outside the clip rectangle start out finalized, so that
+ * blocks on the buffer's edge can complete.
+ */
+void DrawRend::occlude_tile( const std::vector<int> &bin, const SampleRect &clip,
+                             Occlusion &occ ) {
+  occ.blocksX = (clip.x1 - clip.x0 + kBlockSize - 1) / kBlockSize;
+  occ.blocksY = (clip.y1 - clip.y0 + kBlockSize - 1) / kBlockSize;
+  int n = occ.blocksX * occ.blocksY;
+  occ.finalized.assign(n, 0);
+  occ.hiddenBefore.assign(n, 0);
+  occ.tileHiddenBefore = 0;
+
+  // the last column and row of blocks may reach past the clip rectangle
+  int cols = (clip.x1 - clip.x0) - (occ.blocksX - 1) * kBlockSize;
+  int rows = (clip.y1 - clip.y0) - (occ.blocksY - 1) * kBlockSize;
+  for (int by = 0; by < occ.blocksY; by++) {
+    for (int bx = 0; bx < occ.blocksX; bx++) {
+      unsigned long long inside = kBlockFinalized;
+      if (bx == occ.blocksX - 1)
+        inside &= 0x0101010101010101ULL * ((1u << cols) - 1);
+      if (by == occ.blocksY - 1 && rows < kBlockSize)
+        inside &= (1ULL << (rows * kBlockSize)) - 1;
+      occ.finalized[by * occ.blocksX + bx] = ~inside;
+    }
+  }
+
+  int open = n; // blocks not finalized throughout
+
+  TriangleSetup ts[kMaxPieces];
+  for (int i = (int) bin.size() - 1; i >= 0 && open > 0; i--) {
+    const RasterCommand &cmd = commands[bin[i]];
+    if (cmd.type != RasterCommand::CMD_TRIANGLE || cmd.tri || cmd.color.a != 1)
+      continue;
+    int pieces = setup_pieces(cmd.x0, cmd.y0, cmd.x1, cmd.y1, cmd.x2, cmd.y2, clip, ts);
+    for (int j = 0; j < pieces; j++)
+      open -= occlude_triangle(ts[j], i, clip, occ);
+  }
 
-          float alphaR = ((blowupY1 - blowupY2)*((scanX + 1) - blowupX2) + (blowupX2 - blowupX1)*(scanY - blowupY2))/
-                    ((blowupY1 - blowupY2)*(blowupX0 - blowupX2) +(blowupX2 - blowupX1)*(blowupY0 - blowupY2));
-          float betaR = ((blowupY2 - blowupY0)*((scanX + 1) - blowupX2) + (blowupX0 - blowupX2)*(scanY - blowupY2))/
-                   ((blowupY1 - blowupY2)*(blowupX0 - blowupX2) +(blowupX2 - blowupX1)*(blowupY0 - blowupY2));
+  if (open == 0) {
+    occ.tileHiddenBefore = occ.hiddenBefore[0];
+    for (int b = 1; b < n; b++)
+      occ.tileHiddenBefore = std::min(occ.tileHiddenBefore, occ.hiddenBefore[b]);
+  }
+}
 
-          float alphaT = ((blowupY1 - blowupY2)*(scanX - blowupX2) + (blowupX2 - blowupX1)*((scanY + 1)- blowupY2))/
-                    ((blowupY1 - blowupY2)*(blowupX0 - blowupX2) +(blowupX2 - blowupX1)*(blowupY0 - blowupY2));
-          float betaT = ((blowupY2 - blowupY0)*(scanX - blowupX2) + (blowupX0 - blowupX2)*((scanY + 1) - blowupY2))/
-                   ((blowupY1 - blowupY2)*(blowupX0 - blowupX2) +(blowupX2 - blowupX1)*(blowupY0 - blowupY2));
+/**
+ * Sets the finalized bits of the samples the flat triangle ts, at position
+ * in the bin, covers: the samples rasterize_triangle_kernel fills, found by
+ * the same walk over coarse and fine blocks. Returns the number of blocks
+ * it finalized throughout.
+ */
+int DrawRend::occlude_triangle( const TriangleSetup &ts, int position,
+                                const SampleRect &clip, Occlusion &occ ) {
+  int completed = 0;
+  for (int cy = ts.minY & ~(kCoarseBlockSize - 1); cy <= ts.maxY; cy += kCoarseBlockSize) {
+    for (int cx = ts.minX & ~(kCoarseBlockSize - 1); cx <= ts.maxX; cx += kCoarseBlockSize) {
+      BlockCoverage coarse = classify_block(ts, cx, cy, kCoarseBlockSize);
+      if (coarse == BLOCK_OUTSIDE) continue;
+
+      int coarseX0 = std::max(cx, ts.minX), coarseX1 = std::min(cx + kCoarseBlockSize - 1, ts.maxX);
+      int coarseY0 = std::max(cy, ts.minY), coarseY1 = std::min(cy + kCoarseBlockSize - 1, ts.maxY);
+      for (int by = coarseY0 & ~(kBlockSize - 1); by <= coarseY1; by += kBlockSize) {
+        for (int bx = coarseX0 & ~(kBlockSize - 1); bx <= coarseX1; bx += kBlockSize) {
+          int b = (by - clip.y0) / kBlockSize * occ.blocksX + (bx - clip.x0) / kBlockSize;
+          if (occ.finalized[b] == kBlockFinalized) continue;
+
+          BlockCoverage fine = coarse;
+          if (fine == BLOCK_PARTIAL)
+            fine = classify_block(ts, bx, by, kBlockSize);
+          if (fine == BLOCK_OUTSIDE) continue;
+
+          int blockX0 = std::max(bx, ts.minX), blockX1 = std::min(bx + kBlockSize - 1, ts.maxX);
+          int blockY0 = std::max(by, ts.minY), blockY1 = std::min(by + kBlockSize - 1, ts.maxY);
+          unsigned span = (0xFFu << (blockX0 - bx)) & (0xFFu >> (bx + kBlockSize - 1 - blockX1));
+          unsigned long long covered = 0;
+          for (int sy = blockY0; sy <= blockY1; sy++) {
+            unsigned mask = span;
+            if (fine == BLOCK_PARTIAL) {
+              double x = bx + 0.5, y = sy + 0.5;
+              double row[3] = { ts.e[0].eval(x, y), ts.e[1].eval(x, y), ts.e[2].eval(x, y) };
+              mask &= row_coverage(ts, kernels, row);
+            }
+            covered |= (unsigned long long) mask << ((sy - by) * kBlockSize);
+          }
 
-          Vector2D dx = Vector2D(alphaR, betaR);
-          Vector2D dy = Vector2D(alphaT, betaT);
-          Vector2D berycentric = Vector2D(alpha, beta);
-          Color beryColor = tri->color(berycentric, dx, dy, sp);
-          this->DrawRend::rasterize_point(scanX, scanY, beryColor);
-        } else {
-          this->DrawRend::rasterize_point(scanX, scanY, color);
+          occ.finalized[b] |= covered;
+          if (occ.finalized[b] == kBlockFinalized) {
+            occ.hiddenBefore[b] = position;
+            completed++;
+          }
         }
       }
     }
   }
+  return completed;
+}
 
+/**
+ * Returns true if the samples x0..x1 by y0..y1 (inclusive, within clip)
+ * are all hidden from the primitive at clip.position by opaque ones drawn
+ * after it.
+ */
+bool DrawRend::hidden( const SampleRect &clip, int x0, int y0, int x1, int y1 ) {
+  const Occlusion *occ = clip.occlusion;
+  if (!occ) return false;
+  int bx0 = (x0 - clip.x0) / kBlockSize, bx1 = (x1 - clip.x0) / kBlockSize;
+  int by0 = (y0 - clip.y0) / kBlockSize, by1 = (y1 - clip.y0) / kBlockSize;
+  for (int by = by0; by <= by1; by++)
+    for (int bx = bx0; bx <= bx1; bx++)
+      if (occ->hiddenBefore[by * occ->blocksX + bx] <= clip.position)
+        return false;
+  return true;
+}
 
-  // Part 3: Add supersampling to antialias your triangles
+// Strokes are tessellated in element space, so the cached triangles stay
+// valid under any view transform and only need transforming per redraw.
+void DrawRend::rasterize_stroke( SVGElement *element,
+                                 const std::vector<Vector2D> &points, bool closed,
+                                 const Matrix3x3 &transform ) {
+  Color c = element->style.strokeColor;
+  if (c.a == 0) return;
+
+  if (strokes != STROKES_TESSELLATED) {
+    int nPoints = points.size();
+    int nLines = closed ? nPoints : nPoints - 1;
+    for (int i = 0; i < nLines; i++) {
+      Vector2D p0 = transform * points[i];
+      Vector2D p1 = transform * points[(i + 1) % nPoints];
+      rasterize_line( p0.x, p0.y, p1.x, p1.y, c );
+    }
+    return;
+  }
 
+  if (!element->strokeTessellated) {
+    stroke( points, closed, element->style, element->strokeTriangles );
+    element->strokeTessellated = true;
+  }
 
-  // Part 5: Add barycentric coordinates and use tri->color for shading when available
-  // Part 6: Fill in a SampleParams struct with psm, lsm and pass it to the tri->color function
-  // Part 7: Pass in correct barycentric differentials dx and dy to tri->color for mipmapping
+  const std::vector<Vector2D> &triangles = element->strokeTriangles;
+  for (size_t i = 0; i + 2 < triangles.size(); i += 3) {
+    Vector2D p0 = transform * triangles[i + 0];
+    Vector2D p1 = transform * triangles[i + 1];
+    Vector2D p2 = transform * triangles[i + 2];
+    rasterize_triangle( p0.x, p0.y, p1.x, p1.y, p2.x, p2.y, c );
+  }
+}
+
+void DrawRend::rasterize_polygon( Polygon *polygon, const Matrix3x3 &transform,
+                                  Color color ) {
+  if (fill == FILL_TRIANGULATED) {
+    std::vector<Vector2D> triangles;
+    triangulate( *polygon, triangles );
+
+    for (size_t i = 0; i < triangles.size(); i += 3) {
+      Vector2D p0 = transform * triangles[i + 0];
+      Vector2D p1 = transform * triangles[i + 1];
+      Vector2D p2 = transform * triangles[i + 2];
+      rasterize_triangle( p0.x, p0.y, p1.x, p1.y, p2.x, p2.y, color );
+    }
+    return;
+  }
+
+  int n = polygon->points.size();
+  if (n < 3) return;
+  std::vector<Vector2D> points(n);
+  float minX, maxX, minY, maxY;
+  for (int i = 0; i < n; i++) {
+    points[i] = transform * polygon->points[i];
+    float x = points[i].x, y = points[i].y;
+    minX = i ? std::min(minX, x) : x; maxX = i ? std::max(maxX, x) : x;
+    minY = i ? std::min(minY, y) : y; maxY = i ? std::max(maxY, y) : y;
+  }
+
+  if (recording) {
+    RasterCommand cmd = { RasterCommand::CMD_POLYGON, minX, minY, maxX, maxY, 0, 0,
+                          color, NULL, (int) polygonVertices.size(), n,
+                          polygon->style.fillRule };
+    polygonVertices.insert(polygonVertices.end(), points.begin(), points.end());
+    record(cmd);
+  } else {
+    rasterize_polygon(&points[0], n, color, polygon->style.fillRule, buffer_rect());
+  }
+}
+
+void DrawRend::rasterize_polygon( const Vector2D *points, int n, Color color,
+                                  FillRule rule, const SampleRect &clip ) {
+  if (fill == FILL_COVERAGE)
+    rasterize_polygon_coverage(points, n, color, rule, clip);
+  else
+    rasterize_polygon_scanline(points, n, color, rule, clip);
+}
+
+// Coverage this close to 0 or 1 is rounding noise in the accumulation.
+static const double kCoverageEpsilon = 1e-9;
+
+// Adds the cells' share of coverage d spread by font-rs' area formulas over
+// the span [x0,x1] of a row, with x0 <= x1 relative to the row's first cell.
+// Cells beyond last are dropped: they only affect columns to their right.
+static void accumulate_span( double *row, int last, double x0, double x1, double d ) {
+  double x0floor = floor(x0), x1ceil = ceil(x1);
+  if (x0floor > last) return;
+  int x0i = (int) x0floor;
+
+  // within one cell, split by the span's mean position
+  if (x1ceil <= x0floor + 1) {
+    double xmf = 0.5 * (x0 + x1) - x0floor;
+    row[x0i] += d - d * xmf;
+    if (x0i + 1 <= last) row[x0i + 1] += d * xmf;
+    return;
+  }
+
+  // the span enters cell x0i and leaves cell x1i - 1; in between, every
+  // cell gets the same share s
+  double s = 1 / (x1 - x0);
+  double x0f = x0 - x0floor;
+  double a0 = 0.5 * s * (1 - x0f) * (1 - x0f);
+  double x1f = x1 - x1ceil + 1;
+  double am = 0.5 * s * x1f * x1f;
+  row[x0i] += d * a0;
+  if (x1ceil == x0floor + 2) {
+    if (x0i + 1 <= last) row[x0i + 1] += d * (1 - a0 - am);
+    if (x0i + 2 <= last) row[x0i + 2] += d * am;
+    return;
+  }
+  double a1 = s * (1.5 - x0f);
+  if (x0i + 1 <= last) row[x0i + 1] += d * (a1 - a0);
+  int end = (int) std::min(x1ceil - 1, (double) last + 1);
+  for (int xi = x0i + 2; xi < end; xi++)
+    row[xi] += d * s;
+  if (x1ceil - 1 > last) return;
+  int x1i = (int) x1ceil;
+  double a2 = a1 + (x1i - x0i - 3) * s;
+  row[x1i - 1] += d * (1 - a2 - am);
+  if (x1i <= last) row[x1i] += d * am;
+}
+
+// Accumulates the signed area right of the edge p->q into a band of rows
+// [y0,y1) of cells, one row per stride, whose first cell is column left and
+// last cell column left + last. Each row is computed from the edge's end
+// points alone, so a row's cells do not depend on the band it is in. Parts
+// of the edge left of the first cell cover it entirely.
+static void accumulate_edge( double *acc, int stride, int last, int left,
+                             int y0, int y1, Vector2D p, Vector2D q ) {
+  if (!(p.y != q.y)) return;
+  double dir = 1;
+  if (p.y > q.y) {
+    swap(p, q);
+    dir = -1;
+  }
+  double dxdy = (q.x - p.x) / (q.y - p.y);
+  double rowLo = std::max(floor(p.y), (double) y0);
+  double rowHi = std::min(ceil(q.y), (double) y1);
+
+  for (int y = (int) rowLo; y < rowHi; y++) {
+    double ya = std::max((double) y, p.y), yb = std::min(y + 1., q.y);
+    double xa = p.x + (ya - p.y) * dxdy - left;
+    double xb = p.x + (yb - p.y) * dxdy - left;
+    double d = (yb - ya) * dir;
+    double *row = acc + (y - y0) * stride;
+
+    if (xa < 0 || xb < 0) {
+      if (xa < 0 && xb < 0) {
+        row[0] += d;
+        continue;
+      }
+      double t = -xa / (xb - xa);
+      double dLeft = (xa < 0 ? t : 1 - t) * d;
+      row[0] += dLeft;
+      d -= dLeft;
+      if (xa < 0) xa = 0; else xb = 0;
+    }
+    accumulate_span(row, last, std::min(xa, xb), std::max(xa, xb), d);
+  }
+}
+
+/**
+ * Blends color, with its alpha scaled by coverage, into every sample of the
+ * pixels x0..x1 of pixel row y.
+ */
+void DrawRend::fill_pixels( int x0, int x1, int y, Color color, double coverage,
+                            const SampleRect &clip ) {
+  if (coverage < kCoverageEpsilon) return;
+  if (coverage < 1 - kCoverageEpsilon) color.a *= coverage;
+  int sqrtSR = sqrt_sample_rate;
+  for (int sy = y * sqrtSR; sy < (y + 1) * sqrtSR; sy++)
+    fill_span(x0 * sqrtSR, (x1 + 1) * sqrtSR - 1, sy, color, clip);
+}
+
+// Turns a pixel's accumulated winding-weighted area into its coverage: the
+// area clamped to 1 for the non-zero rule, or folded into [0,1] by its
+// parity for the even-odd rule.
+static inline double rule_coverage( double area, FillRule rule ) {
+  area = std::abs(area);
+  if (rule == FILL_EVENODD) {
+    area = fmod(area, 2.);
+    return area > 1 ? 2 - area : area;
+  }
+  return std::min(area, 1.);
+}
+
+/**
+ * Fills a polygon by accumulating the signed area each edge covers in every
+ * pixel it crosses, in the manner of font-rs and libart; a running sum
+ * along each row then gives each pixel's winding-weighted coverage. It is
+ * exact wherever a pixel does not hold overlapping parts of the polygon.
+ * Coverage is computed in pixels, so the fill is antialiased without
+ * supersampling.
+ *
+ * Rows are accumulated in bands of kTileSize, and every row sums from the
+ * same column whatever the clip rectangle, so tiles agree with immediate
+ * rasterization bit for bit.
+ */
+void DrawRend::rasterize_polygon_coverage( const Vector2D *points, int n, Color color,
+                                           FillRule rule, const SampleRect &clip ) {
+  int sqrtSR = sqrt_sample_rate;
+  double minX = points[0].x, maxX = minX, minY = points[0].y, maxY = minY;
+  for (int i = 1; i < n; i++) {
+    minX = std::min(minX, points[i].x); maxX = std::max(maxX, points[i].x);
+    minY = std::min(minY, points[i].y); maxY = std::max(maxY, points[i].y);
+  }
+
+  // rows sum from the polygon's left edge, clamped to the buffer, and
+  // output the columns and rows of the clip rectangle it touches
+  SampleRect pixels = { clip.x0 / sqrtSR, clip.y0 / sqrtSR,
+                        clip.x1 / sqrtSR, clip.y1 / sqrtSR };
+  double left = std::max(floor(minX), 0.);
+  double right = std::min(floor(maxX), pixels.x1 - 1.);
+  double top = std::max(floor(minY), (double) pixels.y0);
+  double bottom = std::min(floor(maxY), pixels.y1 - 1.);
+  if (!(left <= right && top <= bottom && right >= pixels.x0)) return;
+
+  int x0 = (int) left, x1 = (int) right;
+  int stride = x1 - x0 + 1;
+  int first = std::max(x0, pixels.x0);
+  std::vector<double> acc;
+
+  for (int y0 = (int) top; y0 <= (int) bottom; y0 += kTileSize) {
+    int y1 = std::min(y0 + kTileSize, (int) bottom + 1);
+    acc.assign(stride * (y1 - y0), 0.);
+    for (int i = 0; i < n; i++)
+      accumulate_edge(&acc[0], stride, stride - 1, x0, y0, y1,
+                      points[i], points[(i + 1) % n]);
+
+    // sum each row and fill runs of equal coverage together
+    for (int y = y0; y < y1; y++) {
+      const double *row = &acc[0] + (y - y0) * stride;
+      double sum = 0;
+      int runStart = first;
+      for (int x = x0; x <= x1; x++) {
+        if (x > first && row[x - x0] != 0) {
+          fill_pixels(runStart, x - 1, y, color, rule_coverage(sum, rule), clip);
+          runStart = x;
+        }
+        sum += row[x - x0];
+      }
+      fill_pixels(runStart, x1, y, color, rule_coverage(sum, rule), clip);
+    }
+  }
+}
+
+// An edge of the active edge table, in samples. It crosses sample rows
+// first..last, at x = x0 + (y + oy - y0) * dxdy on row y, for samples at
+// height oy within their cell.
+struct ScanEdge {
+  double x0, y0, dxdy;
+  int first, last;
+  int winding; // +1 for edges running down, -1 for edges running up
+  double x;    // at the current row
+};
+
+static bool starts_before( const ScanEdge &a, const ScanEdge &b ) {
+  return a.first < b.first;
+}
 
+/**
+ * Fills a polygon straight from its vertices with an active edge table: the
+ * edges sorted by first sample row join the table as the walk reaches them
+ * and leave it after their last row. On each row the active edges, kept in
+ * x order, are swept left to right counting windings, and the samples whose
+ * centers fall inside by the fill rule are filled as spans. Centers exactly
+ * on an edge belong to the span right of / below it, so polygons sharing an
+ * edge never both cover a sample. Every row's crossings are computed from
+ * the edge's end points, so tiles agree with immediate rasterization.
+ *
+ * Patterns other than ordered grids take one walk per sample of the
+ * pattern, each writing that sample of the pixels in its spans.
+ */
+void DrawRend::rasterize_polygon_scanline( const Vector2D *points, int n, Color color,
+                                           FillRule rule, const SampleRect &clip ) {
+  int sqrtSR = sqrt_sample_rate;
+  SampleSource src = sample_source(color, linear);
+  std::vector<ScanEdge> edges, active;
+  edges.reserve(n);
+
+  for (int k = 0; k < cell_samples; k++) {
+    // position of the walk's samples within their cell
+    double ox = 0.5, oy = 0.5;
+    if (cell_samples > 1) {
+      ox = sample_patterns[pattern].offsets[k][0];
+      oy = sample_patterns[pattern].offsets[k][1];
+    }
 
+    edges.clear();
+    for (int i = 0; i < n; i++) {
+      Vector2D p = sqrtSR * points[i], q = sqrtSR * points[(i + 1) % n];
+      if (!(p.y != q.y)) continue;
+      ScanEdge e;
+      e.winding = 1;
+      if (p.y > q.y) {
+        swap(p, q);
+        e.winding = -1;
+      }
+      double first = std::max(ceil(p.y - oy), (double) clip.y0);
+      double last = std::min(ceil(q.y - oy) - 1, clip.y1 - 1.);
+      if (!(first <= last)) continue;
+      e.x0 = p.x; e.y0 = p.y;
+      e.dxdy = (q.x - p.x) / (q.y - p.y);
+      e.first = (int) first; e.last = (int) last;
+      edges.push_back(e);
+    }
+    if (edges.empty()) continue;
+    std::stable_sort(edges.begin(), edges.end(), starts_before);
+
+    active.clear();
+    size_t next = 0;
+    for (int y = edges[0].first; next < edges.size() || !active.empty(); y++) {
+      // retire finished edges, then skip empty rows and activate new ones
+      size_t kept = 0;
+      for (size_t i = 0; i < active.size(); i++)
+        if (active[i].last >= y) active[kept++] = active[i];
+      active.resize(kept);
+      if (active.empty()) {
+        if (next == edges.size()) break;
+        y = std::max(y, edges[next].first);
+      }
+      while (next < edges.size() && edges[next].first <= y)
+        active.push_back(edges[next++]);
+
+      // the crossings change order only where edges intersect, so an
+      // insertion sort is close to linear
+      for (size_t i = 0; i < active.size(); i++) {
+        ScanEdge e = active[i];
+        e.x = e.x0 + (y + oy - e.y0) * e.dxdy;
+        size_t j = i;
+        for (; j > 0 && active[j - 1].x > e.x; j--)
+          active[j] = active[j - 1];
+        active[j] = e;
+      }
+
+      int winding = 0;
+      double spanX0 = 0;
+      for (size_t i = 0; i < active.size(); i++) {
+        bool wasInside = rule == FILL_EVENODD ? (winding & 1) : winding != 0;
+        winding += active[i].winding;
+        bool inside = rule == FILL_EVENODD ? (winding & 1) : winding != 0;
+        if (inside == wasInside) continue;
+        if (inside) {
+          spanX0 = active[i].x;
+          continue;
+        }
+
+        // cells whose sample lies in [spanX0, x)
+        double x0 = std::max(ceil(spanX0 - ox), (double) clip.x0);
+        double x1 = std::min(ceil(active[i].x - ox) - 1, clip.x1 - 1.);
+        if (!(x0 <= x1)) continue;
+        if (cell_samples == 1) {
+          fill_span((int) x0, (int) x1, y, color, clip);
+          continue;
+        }
+        unsigned char *p = cell(clip, (int) x0, y) + sample_size * k;
+        for (int x = (int) x0; x <= (int) x1; x++, p += sample_size * cell_samples)
+          blend_sample(p, src);
+      }
+    }
+  }
 }
 
 
@@ -7,9 +7,54 @@
 #include <vector>
 #include "GLFW/glfw3.h"
 #include "svg.h"
+#include "simd.h"
 
 namespace CGL {
 
+struct TriangleSetup;
+
+// How strokes are drawn: tessellated into triangles, or as one-pixel lines
+// that are either aliased or blended with their analytic pixel coverage.
+// Antialiased lines cover every sample of a pixel alike, so they look the
+// same at any sample rate.
+typedef enum StrokeMode {
+  STROKES_TESSELLATED = 0,
+  STROKES_HAIRLINE = 1,
+  STROKES_ANTIALIASED = 2
+} StrokeMode;
+
+// How polygons are filled: triangulated and supersampled like every other
+// triangle, by accumulating the signed area their edges cover in each
+// pixel, which gives exact coverage at any sample rate, or by walking an
+// active edge table down the sample rows and filling spans.
+typedef enum FillMode {
+  FILL_TRIANGULATED = 0,
+  FILL_COVERAGE = 1,
+  FILL_SCANLINE = 2
+} FillMode;
+
+// The reconstruction filter resolve() weighs samples with. The box filter
+// averages the samples of each pixel; the others also reach into the
+// neighbouring pixels, 1 (tent) or 2 (Mitchell-Netravali with B = C = 1/3,
+// Lanczos-2) pixels away. Those apply to ordered grids only.
+typedef enum ResolveFilter {
+  FILTER_BOX = 0,
+  FILTER_TENT = 1,
+  FILTER_MITCHELL = 2,
+  FILTER_LANCZOS = 3
+} ResolveFilter;
+
+// A sample pattern: either an ordered grid of grid x grid samples per
+// pixel, kept in the supersample buffer as an image upscaled grid times, or
+// (grid 0) count samples at arbitrary offsets within the pixel, kept side by
+// side per pixel.
+struct SamplePattern {
+  const char *name;
+  int count;
+  int grid;
+  double offsets[8][2];
+};
+
 class DrawRend : public Renderer {
  public:
   DrawRend(std::vector<SVG*> svgs_): 
@@ -57,9 +102,150 @@ class DrawRend : public Renderer {
                            float x2, float y2,
                            Color color, Triangle *tri = NULL );
 
+  // rasterize the stroke of a polyline, or of a polygon outline if closed,
+  // in the element's stroke style, as triangles tessellated on first use
+  // and cached in the element, or as one-pixel lines
+  void rasterize_stroke( SVGElement *element,
+                         const std::vector<Vector2D> &points, bool closed,
+                         const Matrix3x3 &transform );
+
+  // rasterize the fill of a polygon with the current fill engine
+  void rasterize_polygon( Polygon *polygon, const Matrix3x3 &transform,
+                          Color color );
+
 
 
 private:
+  // What the reverse pre-pass over a tile's opaque primitives found: for
+  // each kBlockSize x kBlockSize block of samples of the tile, a bit per
+  // sample that is finalized, i.e. covered by an opaque primitive, and the
+  // position in the bin before which every primitive is hidden in the
+  // block (0 until the block is finalized throughout).
+  struct Occlusion {
+    int blocksX, blocksY;
+    std::vector<unsigned long long> finalized;
+    std::vector<int> hiddenBefore;
+    int tileHiddenBefore;
+  };
+
+  // A rectangle [x0,x1) x [y0,y1) of the supersample grid that
+  // rasterization is restricted to: the whole buffer, or a single tile.
+  // Its samples are kept in rows of stride bytes starting at samples,
+  // which holds the first sample of cell (x0,y0). With occlusion culling,
+  // occlusion tells which blocks the primitive at position in the tile's
+  // bin may skip.
+  struct SampleRect {
+    int x0, y0, x1, y1;
+    unsigned char *samples;
+    int stride;
+    const Occlusion *occlusion;
+    int position;
+  };
+
+  // the first sample of cell (x,y) of clip
+  unsigned char *cell( const SampleRect &clip, int x, int y ) {
+    return clip.samples + (y - clip.y0) * clip.stride + sample_size * cell_samples * (x - clip.x0);
+  }
+
+  // A primitive recorded during SVG::draw, to be rasterized later
+  // into every tile it overlaps.
+  struct RasterCommand {
+    enum Type { CMD_POINT, CMD_LINE, CMD_TRIANGLE, CMD_POLYGON } type;
+    float x0, y0, x1, y1, x2, y2; // a polygon's bounding box in x0..y1
+    Color color;
+    Triangle *tri;
+    int first, count; // a polygon's vertices in polygonVertices
+    FillRule rule;
+  };
+
+  // clipped rasterization routines shared by the immediate and tiled paths
+  void rasterize_point( float x, float y, Color color, const SampleRect &clip );
+  void rasterize_line( float x0, float y0, float x1, float y1,
+                       Color color, const SampleRect &clip );
+  void rasterize_line_antialiased( float x0, float y0, float x1, float y1,
+                                   Color color, const SampleRect &clip );
+  void rasterize_triangle( float x0, float y0, float x1, float y1,
+                           float x2, float y2, Color color, Triangle *tri,
+                           const SampleRect &clip );
+  static const int kMaxPieces = 7;
+
+  // flat triangles with at most kMicroSamples samples in their bounding
+  // box are tested sample by sample
+  static const int kMicroSamples = 16;
+  void rasterize_triangle_micro( const TriangleSetup &ts, Color color,
+                                 const SampleRect &clip );
+  int setup_pieces( float x0, float y0, float x1, float y1, float x2, float y2,
+                    const SampleRect &clip, TriangleSetup *ts );
+  void fill_span( int x0, int x1, int y, Color color, const SampleRect &clip );
+  void fill_pixels( int x0, int x1, int y, Color color, double coverage,
+                    const SampleRect &clip );
+  void rasterize_polygon( const Vector2D *points, int n, Color color,
+                          FillRule rule, const SampleRect &clip );
+  void rasterize_polygon_coverage( const Vector2D *points, int n, Color color,
+                                   FillRule rule, const SampleRect &clip );
+  void rasterize_polygon_scanline( const Vector2D *points, int n, Color color,
+                                   FillRule rule, const SampleRect &clip );
+
+  // Triangle traversal specialized at compile time on the shader. It walks
+  // blocks of samples, so it is the same for every sample grid. One is
+  // picked per triangle from triangle_kernels[shader].
+  typedef void (DrawRend::*TriangleKernel)( const TriangleSetup &ts, Color color,
+                                            Triangle *tri, const SampleRect &clip );
+  static const int kNumShaders = 9;
+  static const TriangleKernel triangle_kernels[kNumShaders];
+  template <class Shader>
+  void rasterize_triangle_kernel( const TriangleSetup &ts, Color color,
+                                  Triangle *tri, const SampleRect &clip );
+
+  // The same, shading once per pixel rather than once per sample; for
+  // sample grids of 2 to 4, from msaa_kernels[sqrtSR - 2][shader].
+  static const TriangleKernel msaa_kernels[3][kNumShaders];
+  template <int kSqrtSR, class Shader>
+  void rasterize_triangle_msaa( const TriangleSetup &ts, Color color,
+                                Triangle *tri, const SampleRect &clip );
+
+  // Traversal for the patterns that are not ordered grids, specialized on
+  // their sample count; from pattern_kernels[log2(count) - 1][shader].
+  static const TriangleKernel pattern_kernels[3][kNumShaders];
+  template <int kSamples, class Shader>
+  void rasterize_triangle_pattern( const TriangleSetup &ts, Color color,
+                                   Triangle *tri, const SampleRect &clip );
+  void set_sample_pattern( int index );
+  void set_sample_layout( int index );
+  size_t buffer_samples();
+  bool tile_resident();
+  int band_rows();
+  void allocate_samples();
+
+  // adaptive supersampling: mark the pixels primitive edges cross, and
+  // those textured triangles cover, then rasterize the blocks holding them
+  // again at the full sample rate
+  void mark_edges( const RasterCommand &cmd );
+  void refine_edges();
+  void resolve( const SampleRect &rect );
+  void resolve_filtered();
+
+  // tiled rasterization: record, bin and execute per tile
+  SampleRect buffer_rect();
+  SampleRect tile_rect( int t );
+  void record( const RasterCommand &cmd );
+  void bin_command( int index );
+  void bin_commands();
+  void flush_tiles( const std::vector<unsigned char> *damaged = NULL );
+  void clear_tile( int t );
+  void clear_buffer();
+  void clear_pixels( int t );
+  void occlude_tile( const std::vector<int> &bin, const SampleRect &clip,
+                     Occlusion &occ );
+  int occlude_triangle( const TriangleSetup &ts, int position,
+                        const SampleRect &clip, Occlusion &occ );
+  bool hidden( const SampleRect &clip, int x0, int y0, int x1, int y1 );
+  void execute( const RasterCommand &cmd, const SampleRect &clip );
+
+  // incremental redraw of the tiles that changed commands overlap
+  std::vector<unsigned char> textured_commands();
+  void redraw_changed( const std::vector<unsigned char> &changed );
+
   // Global state variables for SVGs, pixels, and view transforms
   std::vector<SVG*> svgs; size_t current_svg;
   std::vector<Matrix3x3> svg_to_ndc;
@@ -76,10 +262,82 @@ private:
   bool left_clicked;
   int show_zoom;
   int sample_rate;
+  int sqrt_sample_rate;
+
+  // The sample pattern in use, and how many samples the buffer keeps per
+  // cell of the sample grid: 1 for ordered grids, whose cells are samples,
+  // and the pattern's count for the others, whose cells are pixels (their
+  // sqrt_sample_rate is 1).
+  int pattern;
+  int cell_samples;
   
   PixelSampleMethod psm;
   LevelSampleMethod lsm;
 
+  // tiled backend state; tiles are kTileSize x kTileSize pixels
+  static const int kTileSize = 64;
+
+  // Tile resident samples are drawn and resolved in bands of a tile's
+  // pixel rows holding at most kBandSamples samples, so that a thread's
+  // buffer is the same size at every sample rate. Band heights are
+  // multiples of kBandAlign rows, which keeps the bands on the blocks of
+  // the traversal and of occlusion culling at every sample grid.
+  static const int kBandSamples = 4 * kTileSize * kTileSize;
+  static const int kBandAlign = 8;
+  bool tiled;
+  bool recording;
+  int tiles_x, tiles_y;
+  std::vector<RasterCommand> commands;
+  std::vector<std::vector<int> > bins;
+  std::vector<Vector2D> polygonVertices;
+
+  // whether the commands and bins of the last frame can redraw its tiles
+  bool damageable;
+
+  // whether the samples of each tile in superFramebuffer have been
+  // cleared this frame; the others are white without being stored
+  std::vector<unsigned char> tileCleared;
+
+  // snap triangle vertices to fixed point and fill by the top-left rule
+  bool snap;
+
+  // triangles or one-pixel lines for strokes, see StrokeMode
+  StrokeMode strokes;
+
+  // the polygon fill engine, see FillMode
+  FillMode fill;
+
+  // shade triangles once per pixel and write all its covered samples
+  bool msaa;
+
+  // skip samples that opaque primitives drawn later hide, in tiled mode
+  bool occlude;
+  int culled;
+
+  // Adaptive supersampling: the frame is drawn at one sample per pixel,
+  // and only the blocks of kRefineSize x kRefineSize pixels that hold a
+  // pixel crossed by an edge (edgePixels) are drawn again at the pattern's
+  // rate, each into its slot (refineSlots, -1 if none) of refineSamples.
+  static const int kRefineSize = 8;
+  bool adaptive;
+  std::vector<unsigned char> edgePixels;
+  std::vector<int> refineSlots;
+  std::vector<unsigned char> refineSamples;
+
+  // the reconstruction filter of the resolve, see ResolveFilter
+  ResolveFilter filter;
+
+  // Samples are premultiplied sRGB RGBA8 by default. In linear mode they
+  // are premultiplied RGBA floats in linear light, so that blending and
+  // the resolve average light rather than sRGB values; sample_size is the
+  // size of a sample in bytes.
+  bool linear;
+  int sample_size;
+
+  // vectorized sample kernels; NULL runs the scalar reference path
+  SimdLevel simd;
+  const RasterKernels *kernels;
+
 
   // Part 3: might need to add some variables and functions here
 
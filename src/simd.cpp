@@ -0,0 +1,321 @@
+#include "simd.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// The kernels are compiled for their instruction set with function
+// attributes and picked at runtime, so the rest of the build keeps its
+// baseline target flags.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CGL_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+namespace CGL {
+
+#ifdef CGL_SIMD_X86
+
+// blends src over the sample at p
+static inline void blend1( unsigned char *p, uint32_t src ) {
+  uint32_t d;
+  memcpy(&d, p, 4);
+  d = blend_over(d, src);
+  memcpy(p, &d, 4);
+}
+
+// fills n samples with an opaque src
+static inline void fill_samples( unsigned char *p, int n, uint32_t src ) {
+  for (int k = 0; k < n; k++)
+    memcpy(p + 4 * k, &src, 4);
+}
+
+/****************************************************************************/
+// SSE2: two doubles or four samples per register
+
+__attribute__((target("sse2")))
+static unsigned coverage8_sse2( const double row[3], const double offset[3][8] ) {
+  const __m128d zero = _mm_setzero_pd();
+  unsigned mask = 0xFF;
+  for (int e = 0; e < 3; e++) {
+    __m128d r = _mm_set1_pd(row[e]);
+    unsigned m = 0;
+    for (int k = 0; k < 8; k += 2) {
+      __m128d w = _mm_add_pd(r, _mm_loadu_pd(offset[e] + k));
+      m |= _mm_movemask_pd(_mm_cmpge_pd(w, zero)) << k;
+    }
+    mask &= m;
+  }
+  return mask;
+}
+
+// blends src over four samples, the arithmetic of blend_over in 16 bit lanes
+__attribute__((target("sse2")))
+static inline __m128i blend4_sse2( __m128i px, __m128i src, __m128i ia ) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i half = _mm_set1_epi16(128);
+  __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(px, zero), ia), half);
+  __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(px, zero), ia), half);
+  lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+  hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+  return _mm_add_epi8(src, _mm_packus_epi16(lo, hi));
+}
+
+__attribute__((target("sse2")))
+static void blend8_sse2( unsigned char *p, unsigned mask, uint32_t src ) {
+  const __m128i vsrc = _mm_set1_epi32((int) src);
+  const __m128i ia = _mm_set1_epi16((short) (255 - (src >> 24)));
+  const __m128i bits = _mm_set_epi32(8, 4, 2, 1);
+  for (int k = 0; k < 8; k += 4, mask >>= 4) {
+    if (!(mask & 0xF)) continue;
+    __m128i *q = (__m128i *) (p + 4 * k);
+    __m128i px = _mm_loadu_si128(q);
+    __m128i blended = blend4_sse2(px, vsrc, ia);
+    __m128i sel = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(mask), bits), bits);
+    _mm_storeu_si128(q, _mm_or_si128(_mm_and_si128(sel, blended), _mm_andnot_si128(sel, px)));
+  }
+}
+
+__attribute__((target("sse2")))
+static void blend_span_sse2( unsigned char *p, int n, uint32_t src ) {
+  const __m128i vsrc = _mm_set1_epi32((int) src);
+  int k = 0;
+  if ((src >> 24) == 255) {
+    for (; k + 4 <= n; k += 4)
+      _mm_storeu_si128((__m128i *) (p + 4 * k), vsrc);
+    fill_samples(p + 4 * k, n - k, src);
+    return;
+  }
+  const __m128i ia = _mm_set1_epi16((short) (255 - (src >> 24)));
+  for (; k + 4 <= n; k += 4) {
+    __m128i *q = (__m128i *) (p + 4 * k);
+    _mm_storeu_si128(q, blend4_sse2(_mm_loadu_si128(q), vsrc, ia));
+  }
+  for (; k < n; k++)
+    blend1(p + 4 * k, src);
+}
+
+// Sums each pixel's samples in 16 bit lanes, even samples in the low half
+// of the register and odd ones in the high half, then folds the halves.
+__attribute__((target("sse2")))
+static void resolve_span_sse2( const unsigned char *p, int stride, int rows, int cols,
+                               int n, unsigned char *out ) {
+  if (rows * cols == 1) {
+    memcpy(out, p, 4 * n);
+    return;
+  }
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i recip = _mm_set1_epi16((short) resolve_reciprocal(rows * cols));
+  for (int i = 0; i < n; i++, p += 4 * cols) {
+    __m128i acc = zero;
+    const unsigned char *row = p;
+    for (int r = 0; r < rows; r++, row += stride) {
+      int c = 0;
+      for (; c + 4 <= cols; c += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (row + 4 * c));
+        acc = _mm_add_epi16(acc, _mm_add_epi16(_mm_unpacklo_epi8(v, zero),
+                                               _mm_unpackhi_epi8(v, zero)));
+      }
+      for (; c + 2 <= cols; c += 2) {
+        __m128i v = _mm_loadl_epi64((const __m128i *) (row + 4 * c));
+        acc = _mm_add_epi16(acc, _mm_unpacklo_epi8(v, zero));
+      }
+      if (c < cols) {
+        int s;
+        memcpy(&s, row + 4 * c, 4);
+        acc = _mm_add_epi16(acc, _mm_unpacklo_epi8(_mm_cvtsi32_si128(s), zero));
+      }
+    }
+    __m128i sum = _mm_add_epi16(acc, _mm_srli_si128(acc, 8));
+    __m128i avg = _mm_mulhi_epu16(sum, recip);
+    int px = _mm_cvtsi128_si32(_mm_packus_epi16(avg, avg));
+    memcpy(out + 4 * i, &px, 4);
+  }
+}
+
+// The filter passes accumulate tap by tap in float, in the order the
+// scalar passes of DrawRend::resolve_filtered do, so they agree bit for bit.
+__attribute__((target("sse2")))
+static void filter_column_sse2( const unsigned char *const *rows, int taps, const float *w,
+                                int n, float *out ) {
+  const __m128i zero = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128 acc[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+    for (int k = 0; k < taps; k++) {
+      __m128 wk = _mm_set1_ps(w[k]);
+      __m128i v = _mm_loadu_si128((const __m128i *) (rows[k] + i));
+      __m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+      __m128i x[4] = { _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+                       _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero) };
+      for (int j = 0; j < 4; j++)
+        acc[j] = _mm_add_ps(acc[j], _mm_mul_ps(wk, _mm_cvtepi32_ps(x[j])));
+    }
+    for (int j = 0; j < 4; j++)
+      _mm_storeu_ps(out + i + 4 * j, acc[j]);
+  }
+  for (; i < n; i++) {
+    float acc = 0;
+    for (int k = 0; k < taps; k++)
+      acc += w[k] * rows[k][i];
+    out[i] = acc;
+  }
+}
+
+// clamps an RGBA float pixel to [0,255] and rounds it to RGBA8
+__attribute__((target("sse2")))
+static inline int round_pixel_sse2( __m128 v ) {
+  v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(255.f));
+  __m128i i = _mm_cvttps_epi32(_mm_add_ps(v, _mm_set1_ps(.5f)));
+  i = _mm_packs_epi32(i, i);
+  return _mm_cvtsi128_si32(_mm_packus_epi16(i, i));
+}
+
+__attribute__((target("sse2")))
+static void filter_row_sse2( const float *p, int n, int taps, int step, const float *w,
+                             unsigned char *out ) {
+  for (int i = 0; i < n; i++, p += 4 * step) {
+    __m128 acc = _mm_setzero_ps();
+    for (int k = 0; k < taps; k++)
+      acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(p + 4 * k)));
+    int px = round_pixel_sse2(acc);
+    memcpy(out + 4 * i, &px, 4);
+  }
+}
+
+/****************************************************************************/
+// AVX2: four doubles or eight samples per register
+
+__attribute__((target("avx2")))
+static unsigned coverage8_avx2( const double row[3], const double offset[3][8] ) {
+  const __m256d zero = _mm256_setzero_pd();
+  unsigned mask = 0xFF;
+  for (int e = 0; e < 3; e++) {
+    __m256d r = _mm256_set1_pd(row[e]);
+    __m256d lo = _mm256_add_pd(r, _mm256_loadu_pd(offset[e]));
+    __m256d hi = _mm256_add_pd(r, _mm256_loadu_pd(offset[e] + 4));
+    mask &= _mm256_movemask_pd(_mm256_cmp_pd(lo, zero, _CMP_GE_OQ)) |
+            _mm256_movemask_pd(_mm256_cmp_pd(hi, zero, _CMP_GE_OQ)) << 4;
+  }
+  return mask;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blend8x_avx2( __m256i px, __m256i src, __m256i ia ) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i half = _mm256_set1_epi16(128);
+  __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(px, zero), ia), half);
+  __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(px, zero), ia), half);
+  lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+  hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+  return _mm256_add_epi8(src, _mm256_packus_epi16(lo, hi));
+}
+
+__attribute__((target("avx2")))
+static void blend8_avx2( unsigned char *p, unsigned mask, uint32_t src ) {
+  const __m256i bits = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+  __m256i *q = (__m256i *) p;
+  __m256i px = _mm256_loadu_si256(q);
+  __m256i blended = blend8x_avx2(px, _mm256_set1_epi32((int) src),
+                                 _mm256_set1_epi16((short) (255 - (src >> 24))));
+  __m256i sel = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), bits), bits);
+  _mm256_storeu_si256(q, _mm256_blendv_epi8(px, blended, sel));
+}
+
+__attribute__((target("avx2")))
+static void blend_span_avx2( unsigned char *p, int n, uint32_t src ) {
+  const __m256i vsrc = _mm256_set1_epi32((int) src);
+  int k = 0;
+  if ((src >> 24) == 255) {
+    for (; k + 8 <= n; k += 8)
+      _mm256_storeu_si256((__m256i *) (p + 4 * k), vsrc);
+    fill_samples(p + 4 * k, n - k, src);
+    return;
+  }
+  const __m256i ia = _mm256_set1_epi16((short) (255 - (src >> 24)));
+  for (; k + 8 <= n; k += 8) {
+    __m256i *q = (__m256i *) (p + 4 * k);
+    _mm256_storeu_si256(q, blend8x_avx2(_mm256_loadu_si256(q), vsrc, ia));
+  }
+  for (; k < n; k++)
+    blend1(p + 4 * k, src);
+}
+
+__attribute__((target("avx2")))
+static void filter_column_avx2( const unsigned char *const *rows, int taps, const float *w,
+                                int n, float *out ) {
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256 acc[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(),
+                      _mm256_setzero_ps(), _mm256_setzero_ps() };
+    for (int k = 0; k < taps; k++) {
+      __m256 wk = _mm256_set1_ps(w[k]);
+      for (int j = 0; j < 4; j++) {
+        __m128i v = _mm_loadl_epi64((const __m128i *) (rows[k] + i + 8 * j));
+        __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v));
+        acc[j] = _mm256_add_ps(acc[j], _mm256_mul_ps(wk, x));
+      }
+    }
+    for (int j = 0; j < 4; j++)
+      _mm256_storeu_ps(out + i + 8 * j, acc[j]);
+  }
+  for (; i < n; i++) {
+    float acc = 0;
+    for (int k = 0; k < taps; k++)
+      acc += w[k] * rows[k][i];
+    out[i] = acc;
+  }
+}
+
+// two pixels per register, one in each 128 bit lane
+__attribute__((target("avx2")))
+static void filter_row_avx2( const float *p, int n, int taps, int step, const float *w,
+                             unsigned char *out ) {
+  int i = 0;
+  for (; i + 2 <= n; i += 2, p += 8 * step) {
+    __m256 acc = _mm256_setzero_ps();
+    for (int k = 0; k < taps; k++) {
+      __m256 x = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 4 * k)),
+                                      _mm_loadu_ps(p + 4 * (step + k)), 1);
+      acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(w[k]), x));
+    }
+    int px[2] = { round_pixel_sse2(_mm256_castps256_ps128(acc)),
+                  round_pixel_sse2(_mm256_extractf128_ps(acc, 1)) };
+    memcpy(out + 4 * i, px, 8);
+  }
+  if (i < n)
+    filter_row_sse2(p, n - i, taps, step, w, out + 4 * i);
+}
+
+// A pixel's samples are at most 16 RGBA8 values, which the SSE2 resolve
+// already reads with one load per row; wider registers would not help.
+static const RasterKernels sse2_kernels = { coverage8_sse2, blend8_sse2, blend_span_sse2,
+                                            resolve_span_sse2, filter_column_sse2,
+                                            filter_row_sse2 };
+static const RasterKernels avx2_kernels = { coverage8_avx2, blend8_avx2, blend_span_avx2,
+                                            resolve_span_sse2, filter_column_avx2,
+                                            filter_row_avx2 };
+
+#endif // CGL_SIMD_X86
+
+SimdLevel simd_detect() {
+#ifdef CGL_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+  if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+#endif
+  return SIMD_SCALAR;
+}
+
+const RasterKernels *simd_kernels( SimdLevel level ) {
+#ifdef CGL_SIMD_X86
+  switch (level) {
+    case SIMD_SSE2: return &sse2_kernels;
+    case SIMD_AVX2: return &avx2_kernels;
+    default: break;
+  }
+#endif
+  return NULL;
+}
+
+} // namespace CGL
@@ -0,0 +1,69 @@
+#ifndef CGL_SIMD_H
+#define CGL_SIMD_H
+
+#include <stdint.h>
+
+namespace CGL {
+
+// Instruction sets the vectorized raster kernels exist for. SIMD_SCALAR
+// means no kernels: DrawRend runs its plain per-sample reference code.
+typedef enum SimdLevel { SIMD_SCALAR = 0, SIMD_SSE2 = 1, SIMD_AVX2 = 2 } SimdLevel;
+
+// The sample buffer holds premultiplied RGBA8 samples, which are loaded and
+// stored as 32 bit words (R in the low byte). A premultiplied source src is
+// blended over a sample d as src + d * (255 - alpha of src) / 255 on all four
+// channels alike, rounded to nearest with the identity
+//   x * a / 255 = (t + (t >> 8)) >> 8, t = x * a + 128
+// which is exact for x, a in [0,255]. The sum never exceeds 255, since no
+// channel of a premultiplied color exceeds its alpha.
+inline uint32_t blend_over( uint32_t d, uint32_t src ) {
+  uint32_t ia = 255 - (src >> 24);
+  uint32_t rb = (d & 0x00FF00FF) * ia + 0x00800080;
+  uint32_t ga = ((d >> 8) & 0x00FF00FF) * ia + 0x00800080;
+  rb = ((rb + ((rb >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+  ga = (ga + ((ga >> 8) & 0x00FF00FF)) & 0xFF00FF00;
+  return src + (rb | ga);
+}
+
+// Kernels that process the 8 samples of one row of a traversal block, or a
+// span of samples, at once. The edge value of sample k for edge e is
+// row[e] + offset[e][k]. Blending matches blend_over bit for bit.
+struct RasterKernels {
+  // bit k of the result is set if all three edge values of sample k are >= 0
+  unsigned (*coverage8)( const double row[3], const double offset[3][8] );
+
+  // blends src into the samples of p[0..7] selected by mask
+  void (*blend8)( unsigned char *p, unsigned mask, uint32_t src );
+
+  // blends src into all n samples starting at p
+  void (*blend_span)( unsigned char *p, int n, uint32_t src );
+
+  // averages n pixels into out. Pixel i has rows rows of cols samples, the
+  // first starting at p + 4 * cols * i and the next stride bytes further.
+  void (*resolve_span)( const unsigned char *p, int stride, int rows, int cols,
+                        int n, unsigned char *out );
+
+  // the separable passes of the filtered resolve: out[i] is the sum of
+  // w[k] * rows[k][i] over the taps rows, for n bytes
+  void (*filter_column)( const unsigned char *const *rows, int taps, const float *w,
+                         int n, float *out );
+
+  // RGBA pixel i of out is the sum of w[k] times the RGBA float sample
+  // i * step + k of p over the taps samples, clamped to [0,255] and rounded
+  void (*filter_row)( const float *p, int n, int taps, int step, const float *w,
+                      unsigned char *out );
+};
+
+// 16 bit fixed point reciprocal of a sample count n <= 16: (sum * r) >> 16
+// equals sum / n for every sum of n 8 bit samples.
+inline unsigned resolve_reciprocal( int n ) { return (65536 + n - 1) / n; }
+
+// Returns the best level the CPU we are running on supports.
+SimdLevel simd_detect();
+
+// Returns the kernels for a supported level, or NULL for SIMD_SCALAR.
+const RasterKernels *simd_kernels( SimdLevel level );
+
+} // namespace CGL
+
+#endif // CGL_SIMD_H
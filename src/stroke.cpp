@@ -0,0 +1,153 @@
+#include "stroke.h"
+
+#include <cmath>
+#include <vector>
+
+using namespace std;
+
+namespace CGL {
+
+// largest angle a single triangle of a round join or cap spans. Strokes are
+// tessellated once in element space, so this is fixed rather than derived
+// from the on-screen radius.
+static const double kRoundStep = M_PI / 16;
+
+// segment directions whose cross product is below this are parallel
+static const double kParallel = 1e-9;
+
+static inline void push_triangle( vector<Vector2D>& t,
+                                  Vector2D a, Vector2D b, Vector2D c ) {
+  t.push_back(a);
+  t.push_back(b);
+  t.push_back(c);
+}
+
+// the left-hand normal of a unit direction
+static inline Vector2D normal( Vector2D d ) {
+  return Vector2D(-d.y, d.x);
+}
+
+// triangle fan of radius r around c, from angle a0 through a0 + sweep
+static void fan( vector<Vector2D>& t, Vector2D c, double r,
+                 double a0, double sweep ) {
+  int n = max(1, (int) ceil(fabs(sweep) / kRoundStep));
+  Vector2D prev = c + r * Vector2D(cos(a0), sin(a0));
+  for (int i = 1; i <= n; i++) {
+    double a = a0 + sweep * i / n;
+    Vector2D next = c + r * Vector2D(cos(a), sin(a));
+    push_triangle(t, c, prev, next);
+    prev = next;
+  }
+}
+
+// Fills the gap on the outer side of vertex p, where a segment with unit
+// direction d0 turns into one with direction d1. The inner side is already
+// covered by the overlapping segment quads.
+static void join( vector<Vector2D>& t, Vector2D p, Vector2D d0, Vector2D d1,
+                  double h, const Style& style ) {
+  double c = cross(d0, d1);
+  double cos_turn = dot(d0, d1);
+  if (fabs(c) < kParallel && cos_turn > 0) return;
+
+  // normals pointing away from the turn
+  double side = c > 0 ? -1 : 1;
+  Vector2D n0 = side * normal(d0), n1 = side * normal(d1);
+  Vector2D a = p + h * n0, b = p + h * n1;
+
+  switch (style.lineJoin) {
+    case JOIN_ROUND:
+      fan(t, p, h, atan2(n0.y, n0.x), atan2(cross(n0, n1), dot(n0, n1)));
+      return;
+    case JOIN_MITER: {
+      // the miter length over the stroke width is 1 / sin(theta / 2) for
+      // the angle theta between the segments, and sin(theta / 2) is
+      // sqrt((1 + cos_turn) / 2)
+      double half_sin = sqrt((1 + cos_turn) / 2);
+      if (half_sin * style.miterLimit >= 1) {
+        Vector2D tip = p + h / (1 + cos_turn) * (n0 + n1);
+        push_triangle(t, p, a, tip);
+        push_triangle(t, p, tip, b);
+      } else {
+        // past the miter limit, bevel
+        push_triangle(t, p, a, b);
+      }
+      return;
+    }
+    case JOIN_BEVEL:
+      push_triangle(t, p, a, b);
+      return;
+  }
+}
+
+// caps the stroke end p, where d is the unit direction out of the stroke
+static void cap( vector<Vector2D>& t, Vector2D p, Vector2D d,
+                 double h, const Style& style ) {
+  Vector2D n = normal(d);
+  switch (style.lineCap) {
+    case CAP_ROUND:
+      fan(t, p, h, atan2(n.y, n.x), -M_PI);
+      return;
+    case CAP_SQUARE:
+      push_triangle(t, p + h * n, p - h * n, p + h * (d + n));
+      push_triangle(t, p + h * (d + n), p - h * n, p + h * (d - n));
+      return;
+    case CAP_BUTT:
+      return;
+  }
+}
+
+void stroke(const vector<Vector2D>& points, bool closed,
+            const Style& style, vector<Vector2D>& triangles ) {
+  triangles.clear();
+
+  double h = style.strokeWidth / 2;
+  if (!(h > 0)) return;
+
+  // drop repeated points, which have no direction
+  vector<Vector2D> p;
+  for (size_t i = 0; i < points.size(); i++)
+    if (p.empty() || (points[i] - p.back()).norm2() > 0)
+      p.push_back(points[i]);
+  if (closed && p.size() > 1 && (p.front() - p.back()).norm2() == 0)
+    p.pop_back();
+
+  int n = p.size();
+  if (n == 0) return;
+
+  // a zero-length open subpath only shows its caps: a dot or a square
+  if (n == 1) {
+    if (closed) return;
+    if (style.lineCap == CAP_ROUND)
+      fan(triangles, p[0], h, 0, 2 * M_PI);
+    if (style.lineCap == CAP_SQUARE) {
+      cap(triangles, p[0], Vector2D(1, 0), h, style);
+      cap(triangles, p[0], Vector2D(-1, 0), h, style);
+    }
+    return;
+  }
+
+  int segments = closed ? n : n - 1;
+  vector<Vector2D> d(segments);
+  for (int i = 0; i < segments; i++)
+    d[i] = (p[(i + 1) % n] - p[i]).unit();
+
+  // one quad per segment
+  for (int i = 0; i < segments; i++) {
+    Vector2D o = h * normal(d[i]);
+    Vector2D a = p[i], b = p[(i + 1) % n];
+    push_triangle(triangles, a + o, a - o, b + o);
+    push_triangle(triangles, b + o, a - o, b - o);
+  }
+
+  if (closed) {
+    for (int i = 0; i < n; i++)
+      join(triangles, p[i], d[(i + n - 1) % n], d[i], h, style);
+  } else {
+    for (int i = 1; i < n - 1; i++)
+      join(triangles, p[i], d[i - 1], d[i], h, style);
+    cap(triangles, p[0], -d[0], h, style);
+    cap(triangles, p[n - 1], d[n - 2], h, style);
+  }
+}
+
+} // namespace CGL
@@ -0,0 +1,15 @@
+#ifndef CGL_STROKE_H
+#define CGL_STROKE_H
+
+#include "svg.h"
+
+namespace CGL {
+
+// tessellates the stroke of a polyline, or of a polygon outline if closed,
+// with the width, joins, caps and miter limit of style into a triangle list
+void stroke(const std::vector<Vector2D>& points, bool closed,
+            const Style& style, std::vector<Vector2D>& triangles );
+
+} // namespace CGL
+
+#endif // CGL_STROKE_H
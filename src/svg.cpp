@@ -6,7 +6,6 @@
 
 #include "drawrend.h"
 #include "transforms.h"
-#include "triangulation.h"
 #include <iostream>
 
 #include "CGL/lodepng.h"
@@ -40,6 +39,19 @@ void Triangle::draw(DrawRend *dr, Matrix3x3 global_transform) {
 
 }
 
+/**
+ * Shades the samples of a 2x2 quad selected by mask one at a time, handing
+ * color() the barycentric coordinates of each sample's neighbours as
+ * reconstructed from the quad.
+ */
+void Triangle::color_quad(const Vector2D xy[4], unsigned mask, Color out[4], SampleParams sp) {
+  Vector2D dx = xy[1] - xy[0];
+  Vector2D dy = xy[2] - xy[0];
+  for (int i = 0; i < 4; i++)
+    if (mask & (1 << i))
+      out[i] = color(xy[i], xy[i] + dx, xy[i] + dy, sp);
+}
+
 /** 
  * Returns the appropriate weighted combination of ColorTri's three colors.
  * The xy vector contains the uv coordinates of the point (x,y).
@@ -63,6 +75,16 @@ Color ColorTri::color(Vector2D xy, Vector2D dx, Vector2D dy, SampleParams sp) {
  */
 Color TexTri::color(Vector2D xy, Vector2D dx, Vector2D dy, SampleParams sp) {
   // Part 6: Fill in the uv member of sp and pass it along to tex->sample.
+  // Part 7: Fill in the du and dv members of sp as well
+  sample_params(sp, xy, dx, dy);
+  return tex->sample(sp);
+}
+
+/**
+ * Interpolates the uv coordinates at the barycentric coordinates xy, and
+ * their screen-space derivatives from the neighbours dx and dy, into sp.
+ */
+void TexTri::sample_params(SampleParams &sp, Vector2D xy, Vector2D dx, Vector2D dy) const {
   float alpha = xy.x;
   float beta = xy.y;
   float gamma = 1-alpha-beta;
@@ -70,7 +92,6 @@ Color TexTri::color(Vector2D xy, Vector2D dx, Vector2D dy, SampleParams sp) {
                            alpha*a_uv.y + beta*b_uv.y + gamma*c_uv.y);
   sp.uv = myUV;
 
-  // Part 7: Fill in the du and dv members of sp as well
   float alphaR = dx.x;
   float betaR = dx.y;
   float gammaR = 1-alphaR-betaR;
@@ -90,8 +111,39 @@ Color TexTri::color(Vector2D xy, Vector2D dx, Vector2D dy, SampleParams sp) {
 
   sp.du = Vector2D(du_dx, du_dy);
   sp.dv = Vector2D(dv_dx, dv_dy);
-  
-  return tex->sample(sp);
+}
+
+/**
+ * Returns the colors of the samples of a quad selected by mask. The uv
+ * coordinates are interpolated once per sample, and their derivatives are
+ * the differences to the quad's right and lower neighbours.
+ */
+void TexTri::color_quad(const Vector2D xy[4], unsigned mask, Color out[4], SampleParams sp) {
+  SampleParams quad[4] = { sp, sp, sp, sp };
+  quad_params(quad, xy);
+  for (int i = 0; i < 4; i++)
+    if (mask & (1 << i))
+      out[i] = tex->sample(quad[i]);
+}
+
+void TexTri::quad_params(SampleParams sp[4], const Vector2D xy[4]) const {
+  for (int i = 0; i < 4; i++) {
+    float alpha = xy[i].x;
+    float beta = xy[i].y;
+    float gamma = 1-alpha-beta;
+    sp[i].uv = Vector2D(alpha*a_uv.x + beta*b_uv.x + gamma*c_uv.x,
+                        alpha*a_uv.y + beta*b_uv.y + gamma*c_uv.y);
+  }
+
+  float du_dx = sp[1].uv.x - sp[0].uv.x;
+  float dv_dx = sp[1].uv.y - sp[0].uv.y;
+  float du_dy = sp[2].uv.x - sp[0].uv.x;
+  float dv_dy = sp[2].uv.y - sp[0].uv.y;
+
+  for (int i = 0; i < 4; i++) {
+    sp[i].du = Vector2D(du_dx, du_dy);
+    sp[i].dv = Vector2D(dv_dx, dv_dy);
+  }
 }
 
 
@@ -115,23 +167,16 @@ void Point::draw(DrawRend *dr, Matrix3x3 global_transform) {
 void Line::draw(DrawRend *dr, Matrix3x3 global_transform) {
   global_transform = global_transform * transform;
 
-  Vector2D f = global_transform * from, t = global_transform * to;
-  dr->rasterize_line(f.x, f.y, t.x, t.y, style.strokeColor);
+  std::vector<Vector2D> ends;
+  ends.push_back(from);
+  ends.push_back(to);
+  dr->rasterize_stroke( this, ends, false, global_transform );
 }
 
 void Polyline::draw(DrawRend *dr, Matrix3x3 global_transform) {
   global_transform = global_transform * transform;
 
-  Color c = style.strokeColor;
-
-  if( c.a != 0 ) {
-    int nPoints = points.size();
-    for( int i = 0; i < nPoints - 1; i++ ) {
-      Vector2D p0 = global_transform * points[(i+0) % nPoints];
-      Vector2D p1 = global_transform * points[(i+1) % nPoints];
-      dr->rasterize_line( p0.x, p0.y, p1.x, p1.y, c );
-    }
-  }
+  dr->rasterize_stroke( this, points, false, global_transform );
 }
 
 void Rect::draw(DrawRend *dr, Matrix3x3 global_transform) {
@@ -156,13 +201,12 @@ void Rect::draw(DrawRend *dr, Matrix3x3 global_transform) {
   }
 
   // draw outline
-  c = style.strokeColor;
-  if( c.a != 0 ) {
-    dr->rasterize_line( p0.x, p0.y, p1.x, p1.y, c );
-    dr->rasterize_line( p1.x, p1.y, p3.x, p3.y, c );
-    dr->rasterize_line( p3.x, p3.y, p2.x, p2.y, c );
-    dr->rasterize_line( p2.x, p2.y, p0.x, p0.y, c );
-  }
+  std::vector<Vector2D> corners;
+  corners.push_back( Vector2D(   x   ,   y   ) );
+  corners.push_back( Vector2D( x + w ,   y   ) );
+  corners.push_back( Vector2D( x + w , y + h ) );
+  corners.push_back( Vector2D(   x   , y + h ) );
+  dr->rasterize_stroke( this, corners, true, global_transform );
 }
 
 void Polygon::draw(DrawRend *dr, Matrix3x3 global_transform) {
@@ -173,30 +217,11 @@ void Polygon::draw(DrawRend *dr, Matrix3x3 global_transform) {
   // draw fill
   c = style.fillColor;
   if( c.a != 0 ) {
-
-    // triangulate
-    std::vector<Vector2D> triangles;
-    triangulate( *this, triangles );
-
-    // draw as triangles
-    for (size_t i = 0; i < triangles.size(); i += 3) {
-      Vector2D p0 = global_transform * triangles[i + 0];
-      Vector2D p1 = global_transform * triangles[i + 1];
-      Vector2D p2 = global_transform * triangles[i + 2];
-      dr->rasterize_triangle( p0.x, p0.y, p1.x, p1.y, p2.x, p2.y, c );
-    }
+    dr->rasterize_polygon( this, global_transform, c );
   }
 
   // draw outline
-  c = style.strokeColor;
-  if( c.a != 0 ) {
-    int nPoints = points.size();
-    for( int i = 0; i < nPoints; i++ ) {
-      Vector2D p0 = global_transform * points[(i+0) % nPoints];
-      Vector2D p1 = global_transform * points[(i+1) % nPoints];
-      dr->rasterize_line( p0.x, p0.y, p1.x, p1.y, c );
-    }
-  }
+  dr->rasterize_stroke( this, points, true, global_transform );
 }
 
 void Image::draw(DrawRend *dr, Matrix3x3 global_transform) {
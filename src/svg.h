@@ -35,17 +35,28 @@ typedef enum e_SVGElementType {
   TRIANGLE
 } SVGElementType;
 
+// how stroke segments meet at vertices, and how open strokes end
+typedef enum e_LineJoin { JOIN_MITER = 0, JOIN_ROUND, JOIN_BEVEL } LineJoin;
+typedef enum e_LineCap  { CAP_BUTT = 0, CAP_ROUND, CAP_SQUARE } LineCap;
+
+// which points of a self-overlapping polygon are inside it
+typedef enum e_FillRule { FILL_NONZERO = 0, FILL_EVENODD } FillRule;
+
 struct Style {
   Color strokeColor;
   Color fillColor;
   float strokeWidth;
   float miterLimit;
+  LineJoin lineJoin;
+  LineCap lineCap;
+  FillRule fillRule;
 };
 
 struct SVGElement {
 
   SVGElement( SVGElementType _type ) 
-    : type( _type ), transform( Matrix3x3::identity() ) { }
+    : type( _type ), transform( Matrix3x3::identity() ),
+      strokeTessellated( false ) { }
 
   virtual ~SVGElement() { }
 
@@ -59,6 +70,10 @@ struct SVGElement {
 
   // transformation list
   Matrix3x3 transform;
+
+  // stroke tessellated in element space, built on first draw
+  std::vector<Vector2D> strokeTriangles;
+  bool strokeTessellated;
   
 };
 
@@ -70,6 +85,13 @@ struct Triangle : SVGElement {
   void draw(DrawRend *dr, Matrix3x3 global_transform);
   virtual Color color(Vector2D xy, Vector2D dx = Vector2D(), Vector2D dy = Vector2D(), 
                         SampleParams sp = SampleParams()) = 0;
+
+  // Shades a 2x2 quad of samples in one call. xy holds the barycentric
+  // coordinates of the samples (x,y), (x+1,y), (x,y+1) and (x+1,y+1);
+  // out[i] is written for every bit i set in mask. Derivatives come from
+  // the quad neighbours, which are filled in even where mask is clear.
+  virtual void color_quad(const Vector2D xy[4], unsigned mask, Color out[4],
+                          SampleParams sp = SampleParams());
 };
 
 struct ColorTri : Triangle { 
@@ -95,6 +117,16 @@ struct TexTri : Triangle {
   Color color(Vector2D xy, Vector2D dx = Vector2D(), Vector2D dy = Vector2D(), 
                 SampleParams sp = SampleParams());
 
+  // Fills in the uv, du and dv members of sp for the barycentric
+  // coordinates xy, dx and dy, as color() does before sampling.
+  void sample_params(SampleParams &sp, Vector2D xy, Vector2D dx, Vector2D dy) const;
+
+  // Interpolates uv once per sample of a quad, and takes du and dv from
+  // the quad neighbours.
+  void color_quad(const Vector2D xy[4], unsigned mask, Color out[4],
+                  SampleParams sp = SampleParams());
+  void quad_params(SampleParams sp[4], const Vector2D xy[4]) const;
+
   // Per-vertex uv coordinates. 
   // Should be interpolated between using barycentric coordinates.
   Vector2D a_uv, b_uv, c_uv;
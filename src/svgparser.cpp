@@ -153,6 +153,11 @@ void SVGParser::parseElement( XMLElement* xml, SVGElement* element ) {
   const char* fill_opacity = xml->Attribute( "fill-opacity" );
   if( fill_opacity ) style->fillColor.a = atof( fill_opacity );
 
+  style->fillRule = FILL_NONZERO;
+  const char* fill_rule = xml->Attribute( "fill-rule" );
+  if( fill_rule && string( fill_rule ) == "evenodd" )
+    style->fillRule = FILL_EVENODD;
+
   const char* stroke = xml->Attribute( "stroke" );
   const char* stroke_opacity = xml->Attribute( "stroke-opacity" );
   if( stroke ) {
@@ -164,9 +169,29 @@ void SVGParser::parseElement( XMLElement* xml, SVGElement* element ) {
   }
 
 
+  // SVG defaults for absent stroke attributes
+  style->strokeWidth = 1;
+  style->miterLimit  = 4;
+  style->lineJoin = JOIN_MITER;
+  style->lineCap  = CAP_BUTT;
+
   xml->QueryFloatAttribute( "stroke-width",      &style->strokeWidth );
   xml->QueryFloatAttribute( "stroke-miterlimit", &style->miterLimit  );
 
+  const char* linejoin = xml->Attribute( "stroke-linejoin" );
+  if( linejoin ) {
+    string join = linejoin;
+    if( join == "round" ) style->lineJoin = JOIN_ROUND;
+    if( join == "bevel" ) style->lineJoin = JOIN_BEVEL;
+  }
+
+  const char* linecap = xml->Attribute( "stroke-linecap" );
+  if( linecap ) {
+    string cap = linecap;
+    if( cap == "round"  ) style->lineCap = CAP_ROUND;
+    if( cap == "square" ) style->lineCap = CAP_SQUARE;
+  }
+
   // parse transformation
   const char* trans = xml->Attribute( "transform" );
   if ( trans ) {
@@ -11,32 +11,15 @@ Color Texture::sample(const SampleParams &sp) {
 
   // Part 7: Fill in full sampling (including trilinear), 
   //          conditional on sp.psm and sp.lsm
-  float level = 0;
-  if (sp.lsm == 1){
-    level = max(Texture::get_level(sp), float(0));
+  if (sp.lsm == L_LINEAR){
+    return sample<P_LINEAR, L_LINEAR>(sp);
   }
-  if (sp.lsm == 2){
-    level = max(Texture::get_level(sp), float(0));
-    if (level == 0){
-      return Texture::sample_bilinear(sp.uv, (int)level);
-    }
-    Color levelD_0 = Texture::sample_bilinear(sp.uv, (int) floor(level));
-    Color levelD_1 = Texture::sample_bilinear(sp.uv, (int) ceil(level));
-
-    float weight1 = level - floor(level);
-    float weight0 = ceil(level) - level;
-
-    float newR = weight0*levelD_0.r + weight1*levelD_1.r;
-    float newG = weight0*levelD_0.g + weight1*levelD_1.g;
-    float newB = weight0*levelD_0.b + weight1*levelD_1.b;
-    float newA = weight0*levelD_0.a + weight1*levelD_1.a;
-
-    return Color(newR, newG, newB, newA);
-  }
-  if (sp.psm == 0){
-    return Texture::sample_nearest(sp.uv, (int)level);
+  if (sp.psm == P_NEAREST){
+    return sp.lsm == L_NEAREST ? sample<P_NEAREST, L_NEAREST>(sp)
+                               : sample<P_NEAREST, L_ZERO>(sp);
   } else {
-    return Texture::sample_bilinear(sp.uv, (int)level);
+    return sp.lsm == L_NEAREST ? sample<P_LINEAR, L_NEAREST>(sp)
+                               : sample<P_LINEAR, L_ZERO>(sp);
   }
 }
 
@@ -73,6 +56,11 @@ Color Texture::sample_nearest(Vector2D uv, int level) {
   return Color(colorValues);
 }
 
+// Clamps a texel coordinate to [0, size)
+static inline int clamp_texel(int i, int size) {
+  return min(max(i, 0), size - 1);
+}
+
 // Indexes into the level'th mipmap
 // and returns a bilinearly weighted combination of
 // the four pixels surrounding (u,v)
@@ -90,10 +78,17 @@ Color Texture::sample_bilinear(Vector2D uv, int level) {
   if ((int)(denormX + 0.5) < 0 || (int)(denormX + 0.5) >= texWidth) return Color(255.0, 255.0, 255.0, 255.0);
   if ((int)(denormY + 0.5) < 0 || (int)(denormY + 0.5) >= texHeight) return Color(255.0, 255.0, 255.0, 255.0);
 
-  int blPixel = 4*((int)floor(denormX) + ((int)floor(denormY))*texWidth);
-  int brPixel = 4*((int)ceil(denormX) + ((int)floor(denormY))*texWidth);
-  int tlPixel = 4*((int)floor(denormX) + ((int)ceil(denormY))*texWidth);
-  int trPixel = 4*((int)ceil(denormX) + ((int)ceil(denormY))*texWidth);
+  // the neighbors of a sample near the level's edge can lie outside it;
+  // clamp them to the edge texels
+  int left = clamp_texel((int)floor(denormX), texWidth);
+  int right = clamp_texel((int)ceil(denormX), texWidth);
+  int bottom = clamp_texel((int)floor(denormY), texHeight);
+  int top = clamp_texel((int)ceil(denormY), texHeight);
+
+  int blPixel = 4*(left + bottom*texWidth);
+  int brPixel = 4*(right + bottom*texWidth);
+  int tlPixel = 4*(left + top*texWidth);
+  int trPixel = 4*(right + top*texWidth);
   unsigned char colorValues[4];
   float bottomTwoValues[4];
   float topTwoValues[4];
@@ -170,9 +165,8 @@ void Texture::generate_mips(int startLevel) {
     level.texels = vector<unsigned char>(4 * width * height);
   }
 
-  // create mips
-  int subLevels = numSubLevels - (startLevel + 1);
-  for (int mipLevel = startLevel + 1; mipLevel < startLevel + subLevels + 1;
+  // create mips, down to the last level allocated above
+  for (int mipLevel = startLevel + 1; mipLevel <= startLevel + numSubLevels;
        mipLevel++) {
 
     MipLevel &prevLevel = mipmap[mipLevel - 1];
@@ -49,6 +49,11 @@ struct Texture {
   void generate_mips(int startLevel = 0);
 
   Color sample(const SampleParams &sp);
+
+  // sample() with the pixel and level sampling methods fixed at compile
+  // time, ignoring sp.psm and sp.lsm
+  template <PixelSampleMethod psm, LevelSampleMethod lsm>
+  Color sample(const SampleParams &sp);
   
   float get_level(const SampleParams &sp);
 
@@ -57,6 +62,37 @@ struct Texture {
   Color sample_bilinear(Vector2D uv, int level = 0);
 };
 
+template <PixelSampleMethod psm, LevelSampleMethod lsm>
+inline Color Texture::sample(const SampleParams &sp) {
+  float level = 0;
+  if (lsm == L_NEAREST){
+    level = max(get_level(sp), float(0));
+  }
+  if (lsm == L_LINEAR){
+    level = max(get_level(sp), float(0));
+    if (level == 0){
+      return sample_bilinear(sp.uv, (int)level);
+    }
+    Color levelD_0 = sample_bilinear(sp.uv, (int) floor(level));
+    Color levelD_1 = sample_bilinear(sp.uv, (int) ceil(level));
+
+    float weight1 = level - floor(level);
+    float weight0 = ceil(level) - level;
+
+    float newR = weight0*levelD_0.r + weight1*levelD_1.r;
+    float newG = weight0*levelD_0.g + weight1*levelD_1.g;
+    float newB = weight0*levelD_0.b + weight1*levelD_1.b;
+    float newA = weight0*levelD_0.a + weight1*levelD_1.a;
+
+    return Color(newR, newG, newB, newA);
+  }
+  if (psm == P_NEAREST){
+    return sample_nearest(sp.uv, (int)level);
+  } else {
+    return sample_bilinear(sp.uv, (int)level);
+  }
+}
+
 }
 
 #endif // CGL_TEXTURE_H
\ No newline at end of file